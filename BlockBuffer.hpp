@@ -0,0 +1,74 @@
+#ifndef BLOCKBUFFER_HPP
+#define BLOCKBUFFER_HPP
+
+#include <string>
+#include <memory>
+#include <new>
+#include <stdint.h>
+
+#include "rpc/msgpack.hpp"
+
+using namespace std;
+
+// Immutable, reference-counted block contents. Copying a BlockBuffer only
+// bumps a reference count, so the server can hand blocks to the RPC layer
+// (or the replicator) without duplicating the data.
+class BlockBuffer {
+public:
+    BlockBuffer() {}
+    explicit BlockBuffer(string&& data)
+        : buf(make_shared<const string>(std::move(data))) {}
+
+    const char* data() const { return buf ? buf->data() : ""; }
+    size_t size() const { return buf ? buf->size() : 0; }
+    bool empty() const { return size() == 0; }
+
+    // another owner of the same bytes, for keeping them alive elsewhere
+    const shared_ptr<const string>& share() const { return buf; }
+
+protected:
+    shared_ptr<const string> buf;
+};
+
+namespace clmdep_msgpack {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+// packs as a plain msgpack str, straight from the shared buffer
+template <>
+struct pack<BlockBuffer> {
+    template <typename Stream>
+    packer<Stream>& operator()(packer<Stream>& o, const BlockBuffer& v) const {
+        o.pack_str((uint32_t) v.size());
+        o.pack_str_body(v.data(), (uint32_t) v.size());
+        return o;
+    }
+};
+
+// rpclib turns handler results into a zone-backed object before packing
+// the response. Point the object at our buffer instead of copying it into
+// the zone, and park a reference in the zone so the block stays alive until
+// the response is written even if it is dropped from the store meanwhile.
+template <>
+struct object_with_zone<BlockBuffer> {
+    static void release(void* p) {
+        static_cast<shared_ptr<const string>*>(p)->~shared_ptr<const string>();
+    }
+
+    void operator()(clmdep_msgpack::object::with_zone& o, const BlockBuffer& v) const {
+        o.type = clmdep_msgpack::type::STR;
+        o.via.str.size = (uint32_t) v.size();
+        o.via.str.ptr = v.data();
+        if (v.share()) {
+            void* mem = o.zone.allocate_align(sizeof(shared_ptr<const string>));
+            shared_ptr<const string>* keep = new (mem) shared_ptr<const string>(v.share());
+            o.zone.push_finalizer(&release, keep);
+        }
+    }
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS)
+} // namespace clmdep_msgpack
+
+#endif // BLOCKBUFFER_HPP
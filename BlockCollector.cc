@@ -0,0 +1,279 @@
+#include <sysexits.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_set>
+
+#include "rpc/client.h"
+
+#include "logger.hpp"
+#include "BlockCollector.hpp"
+
+using namespace std;
+
+BlockCollector::BlockCollector(INIReader& t_config, int t_servernum,
+                               unordered_map<string, BlockBuffer>& t_blockStore, mutex& t_storeLock)
+    : servernum(t_servernum), blockStore(t_blockStore), storeLock(t_storeLock),
+      reclaimedBlocks(0), reclaimedBytes(0), passes(0), blockRate(0), byteRate(0),
+      running(false)
+{
+    auto log = logger();
+
+    gc_interval = (int) t_config.GetInteger("ssd", "gc_interval", 10);
+    gc_grace = (int) t_config.GetInteger("ssd", "gc_grace", 600);
+    gc_batch = (int) t_config.GetInteger("ssd", "gc_batch", 1000);
+    if (gc_interval < 0 || gc_grace < 0 || gc_batch <= 0) {
+        log->error("Invalid garbage collection settings: interval {} grace {} batch {}",
+                   gc_interval, gc_grace, gc_batch);
+        exit(EX_CONFIG);
+    }
+
+    sharded = t_config.GetInteger("ssd", "metadata_replicas", 0) > 0;
+    if (!sharded) {
+        return;
+    }
+    int num_servers = (int) t_config.GetInteger("ssd", "num_servers", -1);
+    for (int i = 0; i < num_servers; ++i) {
+        string servconf = t_config.Get("ssd", "server"+std::to_string(i), "");
+        size_t idx = servconf.find(":");
+        if (idx == string::npos) {
+            log->error("Config line {} is invalid", servconf);
+            exit(EX_CONFIG);
+        }
+        ssdhosts.push_back(servconf.substr(0, idx));
+        ssdports.push_back((int) strtol(servconf.substr(idx+1).c_str(), nullptr, 0));
+    }
+}
+
+BlockCollector::~BlockCollector()
+{
+    stop();
+}
+
+void BlockCollector::reference(const string& hash)
+{
+    if (refs[hash]++ == 0) {
+        candidates.erase(hash);
+    }
+}
+
+void BlockCollector::release(const string& hash)
+{
+    auto it = refs.find(hash);
+    if (it == refs.end()) {
+        return;
+    }
+    if (--it->second <= 0) {
+        refs.erase(it);
+        unreferenced(hash);
+    }
+}
+
+void BlockCollector::unreferenced(const string& hash)
+{
+    if (blockStore.count(hash) == 0) {
+        return;
+    }
+    clock::time_point now = clock::now();
+    candidates[hash] = now;
+    queue.push_back(make_pair(now, hash));
+}
+
+void BlockCollector::rebuild(const FileInfoMap& fileMap)
+{
+    refs.clear();
+    candidates.clear();
+    queue.clear();
+    for (auto& file: fileMap) {
+        for (auto& hash: get<1>(file.second)) {
+            refs[block_of(hash)]++;
+        }
+    }
+    for (auto& block: blockStore) {
+        if (refs.count(block.first) == 0) {
+            unreferenced(block.first);
+        }
+    }
+}
+
+void BlockCollector::stored(const string& hash)
+{
+    // restart the grace period: its update_file may still be on the way
+    if (refs.count(hash) == 0) {
+        unreferenced(hash);
+    }
+}
+
+void BlockCollector::update(const list<string>& before, const list<string>& after)
+{
+    // count the new version first so blocks shared by both never hit zero
+    for (auto& hash: after) {
+        reference(block_of(hash));
+    }
+    for (auto& hash: before) {
+        release(block_of(hash));
+    }
+}
+
+void BlockCollector::start()
+{
+    auto log = logger();
+
+    if (gc_interval == 0) {
+        log->info("Block garbage collection disabled");
+        return;
+    }
+    log->info("Collecting unreferenced blocks every {}s after {}s grace", gc_interval, gc_grace);
+
+    running = true;
+    worker = thread(&BlockCollector::run, this);
+}
+
+void BlockCollector::stop()
+{
+    {
+        lock_guard<mutex> lock(waitLock);
+        running = false;
+    }
+    wakeup.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void BlockCollector::run()
+{
+    while (running) {
+        {
+            unique_lock<mutex> lock(waitLock);
+            wakeup.wait_for(lock, chrono::seconds(gc_interval),
+                            [this]() { return !running; });
+        }
+        if (!running) {
+            break;
+        }
+        collect();
+    }
+}
+
+// drops from `batch` the blocks another shard's files still use; false if
+// some peer could not be asked, in which case nothing is safe to reclaim
+bool BlockCollector::referencedElsewhere(vector<string>& batch)
+{
+    auto log = logger();
+
+    for (int i = 0; i < (int) ssdhosts.size() && !batch.empty(); i++) {
+        if (i == servernum) {
+            continue;
+        }
+        try {
+            rpc::client peer(ssdhosts[i], ssdports[i]);
+            peer.set_timeout(RPC_TIMEOUT);
+            vector<string> used = peer.call("referenced_blocks", batch).as<vector<string>>();
+            unordered_set<string> keep(used.begin(), used.end());
+            batch.erase(remove_if(batch.begin(), batch.end(),
+                                  [&](const string& hash) { return keep.count(hash) > 0; }),
+                        batch.end());
+        } catch (std::exception &e) {
+            log->info("Server {} unreachable, postponing collection: {}", i, e.what());
+            return false;
+        }
+    }
+    return true;
+}
+
+void BlockCollector::collect()
+{
+    auto log = logger();
+
+    clock::time_point start = clock::now();
+    clock::time_point cutoff = start - chrono::seconds(gc_grace);
+    uint64_t blocks = 0;
+    uint64_t bytes = 0;
+
+    bool more = true;
+    while (more && running) {
+        // expired candidates, with the time they became unreferenced
+        vector<pair<clock::time_point, string>> expired;
+        {
+            lock_guard<mutex> lock(storeLock);
+            while ((int) expired.size() < gc_batch) {
+                if (queue.empty() || queue.front().first > cutoff) {
+                    more = false;
+                    break;
+                }
+                expired.push_back(queue.front());
+                queue.pop_front();
+            }
+        }
+
+        vector<string> batch;
+        for (auto& entry: expired) {
+            batch.push_back(entry.second);
+        }
+        bool confirmed = !sharded || referencedElsewhere(batch);
+        unordered_set<string> reclaim;
+        if (confirmed) {
+            reclaim.insert(batch.begin(), batch.end());
+        }
+
+        // dropped buffers are freed after the lock is released
+        vector<BlockBuffer> garbage;
+        {
+            lock_guard<mutex> lock(storeLock);
+            clock::time_point now = clock::now();
+            for (auto& entry: expired) {
+                // skip entries superseded by a re-reference or a fresh upload
+                auto candidate = candidates.find(entry.second);
+                if (candidate == candidates.end() || candidate->second != entry.first) {
+                    continue;
+                }
+
+                // still used by another shard: look again after another grace period
+                if (reclaim.count(entry.second) == 0) {
+                    candidate->second = now;
+                    queue.push_back(make_pair(now, entry.second));
+                    continue;
+                }
+                candidates.erase(candidate);
+
+                auto block = blockStore.find(entry.second);
+                if (block == blockStore.end()) {
+                    continue;
+                }
+                bytes += block->second.size();
+                blocks++;
+                garbage.push_back(block->second);
+                blockStore.erase(block);
+            }
+        }
+        if (!confirmed) {
+            break;
+        }
+        this_thread::yield();
+    }
+
+    reclaimedBlocks += blocks;
+    reclaimedBytes += bytes;
+    passes++;
+
+    double seconds = gc_interval + chrono::duration<double>(clock::now() - start).count();
+    lock_guard<mutex> lock(storeLock);
+    blockRate = blocks / seconds;
+    byteRate = bytes / seconds;
+    if (blocks > 0) {
+        log->info("Reclaimed {} unreferenced blocks ({} bytes)", blocks, bytes);
+    }
+}
+
+void BlockCollector::stats(map<string, double>& out)
+{
+    lock_guard<mutex> lock(storeLock);
+    out["gc_candidates"] = candidates.size();
+    out["gc_passes"] = passes;
+    out["gc_reclaimed_blocks"] = reclaimedBlocks;
+    out["gc_reclaimed_bytes"] = reclaimedBytes;
+    out["gc_reclaim_rate_blocks"] = blockRate;
+    out["gc_reclaim_rate_bytes"] = byteRate;
+    out["referenced_blocks"] = refs.size();
+}
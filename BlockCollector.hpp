@@ -0,0 +1,94 @@
+#ifndef BLOCKCOLLECTOR_HPP
+#define BLOCKCOLLECTOR_HPP
+
+#include <string>
+#include <list>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <stdint.h>
+
+#include "inih/INIReader.h"
+
+#include "SurfStoreTypes.hpp"
+#include "BlockBuffer.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+// Reference-counted garbage collection of blocks. Counts come from the block
+// lists of the files in fileMap; an extent counts against its segment
+// block. A block with no references becomes a candidate; it is reclaimed
+// once it has stayed unreferenced for gc_grace seconds, which covers blocks
+// uploaded before their update_file arrives.
+// The collector thread works through candidates in batches of gc_batch,
+// releasing the store lock between batches so RPC threads are never held
+// up for long. When metadata is sharded this server only sees its own
+// shard's files, so each batch is first checked against every peer's
+// references and anything still referenced elsewhere is kept.
+//
+// Every method except start/stop/stats expects storeLock to be held.
+class BlockCollector {
+public:
+    BlockCollector(INIReader& t_config, int t_servernum,
+                   unordered_map<string, BlockBuffer>& t_blockStore, mutex& t_storeLock);
+    ~BlockCollector();
+
+    void rebuild(const FileInfoMap& fileMap);
+    void stored(const string& hash);
+    void update(const list<string>& before, const list<string>& after);
+    bool referenced(const string& hash) const { return refs.count(hash) > 0; }
+
+    void start();
+    void stop();
+
+    // counters for the get_stats rpc
+    void stats(map<string, double>& out);
+
+protected:
+    typedef chrono::steady_clock clock;
+
+    void reference(const string& hash);
+    void release(const string& hash);
+    void unreferenced(const string& hash);
+    void run();
+    void collect();
+    bool referencedElsewhere(vector<string>& batch);
+
+    int gc_interval; // seconds
+    int gc_grace;    // seconds
+    int gc_batch;
+
+    const int servernum;
+    bool sharded; // metadata is partitioned, peers hold other references
+    vector<string> ssdhosts;
+    vector<int> ssdports;
+
+    unordered_map<string, BlockBuffer>& blockStore;
+    mutex& storeLock;
+
+    unordered_map<string, int> refs;
+    unordered_map<string, clock::time_point> candidates;
+    deque<pair<clock::time_point, string>> queue; // candidates in arrival order
+
+    atomic<uint64_t> reclaimedBlocks;
+    atomic<uint64_t> reclaimedBytes;
+    atomic<uint64_t> passes;
+    double blockRate; // blocks per second over the last pass interval
+    double byteRate;
+
+    thread worker;
+    atomic<bool> running;
+    mutex waitLock;
+    condition_variable wakeup;
+
+    const uint64_t RPC_TIMEOUT = 10000; // milliseconds
+};
+
+#endif // BLOCKCOLLECTOR_HPP
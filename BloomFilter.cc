@@ -0,0 +1,83 @@
+#include <string>
+#include <cmath>
+
+#include "Placement.hpp"
+#include "BloomFilter.hpp"
+
+using namespace std;
+
+BloomFilter::BloomFilter()
+    : numBits(0), numHashes(0), count(0)
+{
+}
+
+BloomFilter::BloomFilter(size_t t_bits, int t_hashes)
+    : data((t_bits + 7) / 8, '\0'), numBits(data.size() * 8), numHashes(t_hashes), count(0)
+{
+}
+
+// probes are h1 + i * h2 (double hashing); block hashes are already
+// uniform but extents and test keys may not be, so mix them first. The
+// salts are no server's id, so probes don't track block placement.
+static void probeBase(const string& hash, uint64_t& h1, uint64_t& h2)
+{
+    h1 = placement_hash(hash, -1);
+    h2 = placement_hash(hash, -2) | 1;
+}
+
+void BloomFilter::add(const string& hash)
+{
+    count++;
+    if (numBits == 0) {
+        return;
+    }
+    uint64_t h1, h2;
+    probeBase(hash, h1, h2);
+    for (int i = 0; i < numHashes; i++) {
+        size_t bit = (size_t) ((h1 + (uint64_t) i * h2) % numBits);
+        data[bit / 8] |= (char) (1 << (bit % 8));
+    }
+}
+
+bool BloomFilter::mayContain(const string& hash) const
+{
+    if (numBits == 0) {
+        return true;
+    }
+    uint64_t h1, h2;
+    probeBase(hash, h1, h2);
+    for (int i = 0; i < numHashes; i++) {
+        size_t bit = (size_t) ((h1 + (uint64_t) i * h2) % numBits);
+        if ((data[bit / 8] & (1 << (bit % 8))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void BloomFilter::clear()
+{
+    data.assign(data.size(), '\0');
+    count = 0;
+}
+
+void BloomFilter::assign(const string& t_bits, int t_hashes)
+{
+    data = t_bits;
+    numBits = data.size() * 8;
+    numHashes = t_hashes;
+    count = 0;
+}
+
+size_t BloomFilter::bitsFor(size_t entries, double rate)
+{
+    return (size_t) ceil(-(double) entries * log(rate) / (log(2) * log(2)));
+}
+
+int BloomFilter::hashesFor(size_t bits, size_t entries)
+{
+    if (entries == 0) {
+        return 1;
+    }
+    return max(1, (int) round((double) bits / entries * log(2)));
+}
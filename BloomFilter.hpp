@@ -0,0 +1,40 @@
+#ifndef BLOOMFILTER_HPP
+#define BLOOMFILTER_HPP
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+// Bloom filter over block hashes. Servers keep one of the blocks they hold
+// and ship its bits to clients, which check candidate blocks locally before
+// asking the server exactly. The bits are a plain string so they go over
+// rpc as-is.
+class BloomFilter {
+public:
+    // a filter without bits may contain anything
+    BloomFilter();
+    BloomFilter(size_t t_bits, int t_hashes);
+
+    void add(const string& hash);
+    bool mayContain(const string& hash) const;
+    void clear();
+
+    size_t entries() const { return count; }
+    int hashes() const { return numHashes; }
+    const string& bits() const { return data; }
+    void assign(const string& t_bits, int t_hashes);
+
+    // bits and hash count for about `entries` blocks at a false positive
+    // rate of `rate`
+    static size_t bitsFor(size_t entries, double rate);
+    static int hashesFor(size_t bits, size_t entries);
+
+private:
+    string data;
+    size_t numBits;
+    int numHashes;
+    size_t count;
+};
+
+#endif // BLOOMFILTER_HPP
@@ -0,0 +1,155 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "picosha2/picosha2.h"
+
+#include "logger.hpp"
+#include "Delta.hpp"
+
+using namespace std;
+
+static const size_t STRONG_LEN = 16; // hex digits kept, 64 bits
+static const size_t COPY_OVERHEAD = 80; // a copy op's hash and framing on the wire
+
+uint32_t weak_checksum(const char* p, size_t n)
+{
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < n; i++) {
+        a += (unsigned char) p[i];
+        b += (uint32_t) (n - i) * (unsigned char) p[i];
+    }
+    return ((b & 0xffff) << 16) | (a & 0xffff);
+}
+
+string strong_checksum(const char* p, size_t n)
+{
+    return picosha2::hash256_hex_string(p, p + n).substr(0, STRONG_LEN);
+}
+
+vector<BlockSignature> compute_signatures(const string& hash, const string& data, int chunk)
+{
+    vector<BlockSignature> sigs;
+    for (size_t off = 0; off < data.size(); off += chunk) {
+        size_t len = min((size_t) chunk, data.size() - off);
+        sigs.push_back(make_tuple(hash, (int) off, (int) len,
+                                  (unsigned int) weak_checksum(data.data() + off, len),
+                                  strong_checksum(data.data() + off, len)));
+    }
+    return sigs;
+}
+
+vector<DeltaOp> compute_delta(const string& data, const vector<BlockSignature>& sigs,
+                              size_t& literal)
+{
+    vector<DeltaOp> ops;
+    literal = 0;
+
+    // chunks are matched at a single window size: the common one
+    size_t window = 0;
+    unordered_multimap<uint32_t, size_t> index;
+    for (size_t i = 0; i < sigs.size(); i++) {
+        size_t len = get<2>(sigs[i]);
+        if (window == 0) {
+            window = len;
+        }
+        if (len == window) {
+            index.insert(make_pair((uint32_t) get<3>(sigs[i]), i));
+        }
+    }
+
+    string pending;
+    auto flush = [&]() {
+        if (!pending.empty()) {
+            literal += pending.size();
+            ops.push_back(make_tuple(string(), 0, 0, pending));
+            pending.clear();
+        }
+    };
+    auto copy = [&](const BlockSignature& sig) {
+        flush();
+        // extend the previous copy when the source continues
+        if (!ops.empty()) {
+            DeltaOp& last = ops.back();
+            if (get<0>(last) == get<0>(sig) && get<1>(last) + get<2>(last) == get<1>(sig)) {
+                get<2>(last) += get<2>(sig);
+                return;
+            }
+        }
+        ops.push_back(make_tuple(get<0>(sig), get<1>(sig), get<2>(sig), string()));
+    };
+
+    const unsigned char* p = (const unsigned char*) data.data();
+    size_t n = data.size();
+    size_t i = 0;
+    bool fresh = true;
+    uint32_t a = 0, b = 0;
+
+    while (window > 0 && i + window <= n) {
+        if (fresh) {
+            uint32_t sum = weak_checksum(data.data() + i, window);
+            a = sum & 0xffff;
+            b = sum >> 16;
+            fresh = false;
+        }
+
+        uint32_t weak = ((b & 0xffff) << 16) | (a & 0xffff);
+        bool matched = false;
+        auto range = index.equal_range(weak);
+        if (range.first != range.second) {
+            string strong = strong_checksum(data.data() + i, window);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (get<4>(sigs[it->second]) == strong) {
+                    copy(sigs[it->second]);
+                    i += window;
+                    fresh = true;
+                    matched = true;
+                    break;
+                }
+            }
+        }
+        if (matched) {
+            continue;
+        }
+
+        // roll the window one byte forward
+        pending.push_back(data[i]);
+        if (i + window < n) {
+            a = (a - p[i] + p[i + window]) & 0xffff;
+            b = (b - (uint32_t) window * p[i] + a) & 0xffff;
+        }
+        i++;
+    }
+
+    pending.append(data, i, string::npos);
+    flush();
+    return ops;
+}
+
+size_t delta_size(const vector<DeltaOp>& ops)
+{
+    size_t size = 0;
+    for (auto& op: ops) {
+        size += get<0>(op).empty() ? get<3>(op).size() + 8 : COPY_OVERHEAD;
+    }
+    return size;
+}
+
+bool apply_delta(const vector<DeltaOp>& ops, const unordered_map<string, BlockBuffer>& sources,
+                 string& out)
+{
+    out.clear();
+    for (auto& op: ops) {
+        if (get<0>(op).empty()) {
+            out.append(get<3>(op));
+            continue;
+        }
+        auto it = sources.find(get<0>(op));
+        if (it == sources.end() || get<1>(op) < 0 || get<2>(op) < 0 ||
+            (size_t) get<1>(op) + get<2>(op) > it->second.size()) {
+            return false;
+        }
+        out.append(it->second.data() + get<1>(op), get<2>(op));
+    }
+    return true;
+}
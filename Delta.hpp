@@ -0,0 +1,37 @@
+#ifndef DELTA_HPP
+#define DELTA_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+#include "SurfStoreTypes.hpp"
+#include "BlockBuffer.hpp"
+
+using namespace std;
+
+// rsync-style delta encoding of blocks against blocks the server already has
+
+// rsync's weak checksum of n bytes, cheap to roll one byte at a time
+uint32_t weak_checksum(const char* p, size_t n);
+// truncated sha-256 confirming a weak match
+string strong_checksum(const char* p, size_t n);
+
+// signatures of `data` (stored under `hash`) in chunks of `chunk` bytes
+vector<BlockSignature> compute_signatures(const string& hash, const string& data, int chunk);
+
+// encode `data` as copies out of signed chunks plus literal bytes; sets
+// `literal` to the number of literal bytes in the result
+vector<DeltaOp> compute_delta(const string& data, const vector<BlockSignature>& sigs,
+                              size_t& literal);
+
+// bytes a delta costs on the wire, roughly
+size_t delta_size(const vector<DeltaOp>& ops);
+
+// rebuild a block; false if an op reaches outside its source block or a
+// source is missing from `sources`
+bool apply_delta(const vector<DeltaOp>& ops, const unordered_map<string, BlockBuffer>& sources,
+                 string& out);
+
+#endif // DELTA_HPP
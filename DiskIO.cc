@@ -0,0 +1,329 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdexcept>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "logger.hpp"
+#include "DiskIO.hpp"
+
+using namespace std;
+
+IORequest IORequest::open(const string& path, int flags)
+{
+    IORequest r;
+    r.op = OPEN;
+    r.path = path;
+    r.flags = flags;
+    r.fd = -1;
+    r.offset = 0;
+    r.buf = nullptr;
+    r.len = 0;
+    r.result = 0;
+    return r;
+}
+
+IORequest IORequest::read(int fd, uint64_t offset, char* buf, size_t len)
+{
+    IORequest r = open(string(), 0);
+    r.op = READ;
+    r.fd = fd;
+    r.offset = offset;
+    r.buf = buf;
+    r.len = len;
+    return r;
+}
+
+IORequest IORequest::write(int fd, uint64_t offset, const char* buf, size_t len)
+{
+    IORequest r = read(fd, offset, const_cast<char*>(buf), len);
+    r.op = WRITE;
+    return r;
+}
+
+unique_ptr<DiskIO> DiskIO::create(const string& backend, int depth)
+{
+    auto log = logger();
+
+    if (backend == "uring") {
+#ifdef SURFSTORE_HAVE_LIBURING
+        try {
+            return unique_ptr<DiskIO>(new UringIO(depth));
+        } catch (std::exception &e) {
+            log->info("io_uring unavailable, using threads: {}", e.what());
+        }
+#else
+        log->info("Built without io_uring (make URING=1), using threads");
+#endif
+    }
+    return unique_ptr<DiskIO>(new ThreadPoolIO(depth));
+}
+
+// one request to completion, retrying short transfers and interrupts
+static void perform(IORequest& r)
+{
+    if (r.op == IORequest::OPEN) {
+        int fd;
+        do {
+            fd = ::open(r.path.c_str(), r.flags | O_CLOEXEC, 0644);
+        } while (fd < 0 && errno == EINTR);
+        r.result = fd < 0 ? -errno : fd;
+        return;
+    }
+
+    size_t done = 0;
+    while (done < r.len) {
+        ssize_t n = r.op == IORequest::READ
+            ? pread(r.fd, r.buf + done, r.len - done, r.offset + done)
+            : pwrite(r.fd, r.buf + done, r.len - done, r.offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            r.result = -errno;
+            return;
+        }
+        if (n == 0) {
+            break; // end of file
+        }
+        done += n;
+    }
+    r.result = done;
+}
+
+ThreadPoolIO::ThreadPoolIO(int depth)
+    : batch(nullptr), next(0), remaining(0), stopping(false)
+{
+    for (int i = 0; i < max(depth, 1); i++) {
+        workers.push_back(thread(&ThreadPoolIO::work, this));
+    }
+}
+
+ThreadPoolIO::~ThreadPoolIO()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+void ThreadPoolIO::submit(vector<IORequest>& requests)
+{
+    if (requests.empty()) {
+        return;
+    }
+    unique_lock<mutex> guard(lock);
+    batch = &requests;
+    next = 0;
+    remaining = requests.size();
+    ready.notify_all();
+    finished.wait(guard, [this]() { return remaining == 0; });
+    batch = nullptr;
+}
+
+void ThreadPoolIO::work()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        ready.wait(guard, [this]() { return stopping || (batch && next < batch->size()); });
+        if (stopping) {
+            return;
+        }
+        IORequest& r = (*batch)[next++];
+        guard.unlock();
+        perform(r);
+        guard.lock();
+        if (--remaining == 0) {
+            finished.notify_all();
+        }
+    }
+}
+
+#ifdef SURFSTORE_HAVE_LIBURING
+// user_data of cancel requests, which no request index can be
+static const uintptr_t CANCEL_TAG = UINTPTR_MAX;
+
+UringIO::UringIO(int t_depth)
+    : depth((unsigned) max(t_depth, 1)), broken(false)
+{
+    int err = io_uring_queue_init(depth, &ring, 0);
+    if (err < 0) {
+        throw runtime_error(string("io_uring_queue_init: ") + strerror(-err));
+    }
+}
+
+UringIO::~UringIO()
+{
+    if (!broken) {
+        io_uring_queue_exit(&ring);
+    }
+}
+
+// queues what is left of `request` after `done` bytes; false if the
+// submission queue is full
+bool UringIO::prepare(IORequest& request, size_t index, size_t done)
+{
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+        return false;
+    }
+    switch (request.op) {
+    case IORequest::OPEN:
+        io_uring_prep_openat(sqe, AT_FDCWD, request.path.c_str(), request.flags | O_CLOEXEC, 0644);
+        break;
+    case IORequest::READ:
+        io_uring_prep_read(sqe, request.fd, request.buf + done,
+                           (unsigned) (request.len - done), request.offset + done);
+        break;
+    case IORequest::WRITE:
+        io_uring_prep_write(sqe, request.fd, request.buf + done,
+                            (unsigned) (request.len - done), request.offset + done);
+        break;
+    }
+    io_uring_sqe_set_data(sqe, (void*) (uintptr_t) index);
+    return true;
+}
+
+void UringIO::submit(vector<IORequest>& requests)
+{
+    // a ring we had to give up on: run everything synchronously
+    if (broken) {
+        for (auto& r: requests) {
+            perform(r);
+        }
+        return;
+    }
+
+    vector<size_t> done(requests.size(), 0);
+    vector<bool> finished(requests.size(), false);
+    vector<bool> queued(requests.size(), false); // has an sqe in the ring
+    deque<size_t> retry; // short transfers and interrupted requests to continue
+    size_t next = 0;
+    size_t inflight = 0;
+    size_t completed = 0;
+
+    // reaps every completion that is ready
+    auto reap = [&]() {
+        struct io_uring_cqe* cqe;
+        unsigned head;
+        unsigned seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            seen++;
+            uintptr_t tag = (uintptr_t) io_uring_cqe_get_data(cqe);
+            if (tag == CANCEL_TAG) {
+                continue;
+            }
+            size_t i = (size_t) tag;
+            IORequest& r = requests[i];
+            int res = cqe->res;
+            queued[i] = false;
+            inflight--;
+
+            if (r.op == IORequest::OPEN || res < 0) {
+                if (res == -EINTR || res == -EAGAIN || res == -ECANCELED) {
+                    retry.push_back(i);
+                    continue;
+                }
+                r.result = res;
+                finished[i] = true;
+                completed++;
+                continue;
+            }
+            done[i] += res;
+            if (res > 0 && done[i] < r.len) {
+                retry.push_back(i);
+                continue;
+            }
+            r.result = done[i];
+            finished[i] = true;
+            completed++;
+        }
+        io_uring_cq_advance(&ring, seen);
+    };
+
+    while (completed < requests.size()) {
+        // keep the ring full
+        while (inflight < depth && (!retry.empty() || next < requests.size())) {
+            size_t i = retry.empty() ? next : retry.front();
+            if (!prepare(requests[i], i, done[i])) {
+                break;
+            }
+            if (retry.empty()) {
+                next++;
+            } else {
+                retry.pop_front();
+            }
+            queued[i] = true;
+            inflight++;
+        }
+        io_uring_submit(&ring);
+
+        struct io_uring_cqe* cqe;
+        int err = io_uring_wait_cqe(&ring, &cqe);
+        if (err == -EINTR) {
+            continue;
+        }
+        if (err < 0) {
+            logger()->error("io_uring_wait_cqe: {}", strerror(-err));
+            abandon(requests, queued, inflight, reap);
+            // nothing is in flight any more, so the rest can be redone
+            // synchronously; positioned reads and writes are safe to repeat
+            for (size_t i = 0; i < requests.size(); i++) {
+                if (!finished[i]) {
+                    perform(requests[i]);
+                }
+            }
+            return;
+        }
+        reap();
+    }
+}
+
+// cancels everything still in the ring and waits for it, so no late
+// completion writes into a buffer or opens a file after we give the batch
+// up; if even that fails the ring is torn down and not used again
+template <typename F>
+void UringIO::abandon(vector<IORequest>& requests, vector<bool>& queued, size_t& inflight, F reap)
+{
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (!queued[i]) {
+            continue;
+        }
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (sqe == nullptr) {
+            io_uring_submit(&ring);
+            sqe = io_uring_get_sqe(&ring);
+        }
+        if (sqe == nullptr) {
+            break; // the rest still complete on their own
+        }
+        io_uring_prep_cancel(sqe, (void*) (uintptr_t) i, 0);
+        io_uring_sqe_set_data(sqe, (void*) CANCEL_TAG);
+    }
+    io_uring_submit(&ring);
+
+    while (inflight > 0) {
+        struct io_uring_cqe* cqe;
+        int err = io_uring_wait_cqe(&ring, &cqe);
+        if (err == -EINTR) {
+            continue;
+        }
+        if (err < 0) {
+            break;
+        }
+        reap();
+    }
+    if (inflight > 0) {
+        logger()->error("io_uring: {} requests would not drain, giving up the ring", inflight);
+        io_uring_queue_exit(&ring);
+        broken = true;
+    }
+}
+#endif
@@ -0,0 +1,97 @@
+#ifndef DISKIO_HPP
+#define DISKIO_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef SURFSTORE_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+// One open, read or write. result is the fd for an open, the bytes moved
+// for a read or write (short only at end of file), or -errno.
+struct IORequest {
+    enum Op { OPEN, READ, WRITE };
+
+    Op op;
+    string path; // OPEN
+    int flags; // OPEN
+    int fd; // READ, WRITE
+    uint64_t offset;
+    char* buf;
+    size_t len;
+    ssize_t result;
+
+    static IORequest open(const string& path, int flags);
+    static IORequest read(int fd, uint64_t offset, char* buf, size_t len);
+    static IORequest write(int fd, uint64_t offset, const char* buf, size_t len);
+};
+
+// Runs batches of file I/O with many requests in flight at once, so many
+// small files keep the disk's queue full rather than waiting on each
+// syscall in turn.
+class DiskIO {
+public:
+    // "uring" when built with URING=1 and the kernel allows it, otherwise
+    // a pool of `depth` threads issuing pread/pwrite
+    static unique_ptr<DiskIO> create(const string& backend, int depth);
+
+    virtual ~DiskIO() {}
+
+    // runs every request, up to the queue depth at a time; returns once
+    // all of them have completed
+    virtual void submit(vector<IORequest>& requests) = 0;
+    virtual const char* name() const = 0;
+};
+
+class ThreadPoolIO : public DiskIO {
+public:
+    explicit ThreadPoolIO(int depth);
+    ~ThreadPoolIO();
+
+    void submit(vector<IORequest>& requests);
+    const char* name() const { return "threads"; }
+
+private:
+    void work();
+
+    vector<thread> workers;
+    mutex lock;
+    condition_variable ready;
+    condition_variable finished;
+    vector<IORequest>* batch; // guarded by lock
+    size_t next; // next request to hand out
+    size_t remaining; // requests not yet completed
+    bool stopping;
+};
+
+#ifdef SURFSTORE_HAVE_LIBURING
+class UringIO : public DiskIO {
+public:
+    // throws if the ring can't be set up
+    explicit UringIO(int depth);
+    ~UringIO();
+
+    void submit(vector<IORequest>& requests);
+    const char* name() const { return "uring"; }
+
+private:
+    bool prepare(IORequest& request, size_t index, size_t done);
+    template <typename F>
+    void abandon(vector<IORequest>& requests, vector<bool>& queued, size_t& inflight, F reap);
+
+    struct io_uring ring;
+    unsigned depth;
+    bool broken; // torn down after a failure; requests run synchronously
+};
+#endif
+
+#endif // DISKIO_HPP
@@ -4,6 +4,13 @@
 #include <iostream>
 #include <assert.h>
 #include <errno.h>
+#include <thread>
+#include <unordered_set>
+#include <memory>
+#include <future>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
 
 #include "rpc/server.h"
 #include "rpc/rpc_error.h"
@@ -11,6 +18,10 @@
 
 #include "logger.hpp"
 #include "Downloader.hpp"
+#include "FetchScheduler.hpp"
+#include "Trace.hpp"
+#include "DiskIO.hpp"
+#include "MetadataCache.hpp"
 
 using namespace std;
 
@@ -42,6 +53,13 @@ using namespace std;
     }
     log->info("Number of servers: {}", num_servers);
 
+    // servers per metadata shard, 0 keeps every file's metadata everywhere
+    metadata_replicas = (int) config.GetInteger("ssd", "metadata_replicas", 0);
+    if (metadata_replicas < 0) {
+        log->error("Invalid metadata replica count: {}", metadata_replicas);
+        exit(EX_CONFIG);
+    }
+
     for (int i = 0; i < num_servers; ++i) {
         string servconf = config.Get("ssd", "server"+std::to_string(i), "");
         if (servconf == "") {
@@ -65,6 +83,30 @@ using namespace std;
         ssdports.push_back(port);
     }
 
+    // parallel block requests kept open to each server
+    streams_per_server = (int) config.GetInteger("downloader", "streams_per_server", 2);
+    if (streams_per_server <= 0) {
+        log->error("Invalid streams per server: {}", streams_per_server);
+        exit(EX_CONFIG);
+    }
+    log->info("Using {} streams per server", streams_per_server);
+
+    // disk I/O engine for writing files out
+    io_depth = (int) config.GetInteger("downloader", "io_depth", 64);
+    if (io_depth <= 0) {
+        log->error("Invalid I/O queue depth: {}", io_depth);
+        exit(EX_CONFIG);
+    }
+    io = DiskIO::create(config.Get("downloader", "io_backend", "threads"), io_depth);
+    log->info("Writing files through {} I/O, depth {}", io->name(), io_depth);
+
+    // re-list every follow_ms and fetch what changed, 0 downloads once
+    follow_ms = (int) config.GetInteger("downloader", "follow_ms", 0);
+    if (follow_ms < 0) {
+        log->error("Invalid follow interval: {}", follow_ms);
+        exit(EX_CONFIG);
+    }
+
     // mark which server is localserver
     localserver = local;
     log->info("Downloader initalized");
@@ -74,8 +116,9 @@ void Downloader::download()
 {
     auto log = logger();
 
+    trace_start(config.Get("downloader", "trace_file", ""), "downloader");
+
     vector<rpc::client*> clients;
-    vector<unordered_map<string, string>> blockStores;
 
     // Connect to all of the servers
     for (int i = 0; i < num_servers; ++i)
@@ -103,18 +146,32 @@ void Downloader::download()
         }
     }
 
-    // Get file info map from local servers
-    try{
-        fileInfoMap = clients[localserver]->call("get_fileinfo_map").as<FileInfoMap>();
-    } catch (rpc::rpc_error) {
-        log->error("Error retrieving local server file info map");
+    // Get file info map from local servers, or from every shard; in follow
+    // mode the cache's leases answer the repeated listings
+    unique_ptr<MetadataCache> cache;
+    if (follow_ms > 0)
+    {
+        cache.reset(new MetadataCache(ssdhosts, ssdports, metadata_replicas, localserver));
+        fileInfoMap = cache->listing();
+    }
+    else if (metadata_replicas > 0)
+    {
+        fileInfoMap = listNamespace(clients);
+    }
+    else
+    {
+        try{
+            fileInfoMap = clients[localserver]->call("get_fileinfo_map").as<FileInfoMap>();
+        } catch (rpc::rpc_error) {
+            log->error("Error retrieving local server file info map");
+        }
     }
 
     // store all the average rtt times for each server
     chrono::time_point<chrono::system_clock> start, end;
     chrono::duration<double> elapsed_seconds;
     double totalTime = 0;
-    double rtt [4];
+    vector<double> rtt(num_servers);
 
     // Issue a ping to each server 8 times
     for (int i = 0; i < num_servers; ++i)
@@ -139,103 +196,277 @@ void Downloader::download()
         rtt[i] = (totalTime / 8);
     }
 
-    // Download all file blocks from shortest RTT servers
-    for(int i = 0; i < 4; i++){
-        log->error("RTT[{}] : {}", i, rtt[i]);
+    load.reset(num_servers);
+    for (int i = 0; i < num_servers; i++){
+        log->info("RTT[{}] : {}", i, rtt[i]);
+        load.setRTT(i, rtt[i]);
     }
 
-    int shortestRTT[4];
+    fetchFiles(clients);
 
-    double shortestTime = 99999;
-    double lastShortestTime = -1;
-
-    for(int i = 0; i < num_servers; i++){
-        shortestTime = 99999;
-        for(int j = 0; j < num_servers; j++){
-            if(rtt[j] < shortestTime && rtt[j] > lastShortestTime){
-                shortestRTT[i] = j;
-                shortestTime = rtt[j];
+    // follow mode: keep base_dir in step with the servers, fetching only
+    // the files that changed since the last pass
+    FileInfoMap synced = fileInfoMap;
+    while (follow_ms > 0)
+    {
+        this_thread::sleep_for(chrono::milliseconds(follow_ms));
+        FileInfoMap listing = cache->listing();
+        fileInfoMap.clear();
+        for (auto& file: listing)
+        {
+            auto it = synced.find(file.first);
+            if (it == synced.end() || it->second != file.second)
+            {
+                fileInfoMap.insert(file);
             }
         }
-        lastShortestTime = shortestTime;
+        LOG_VERBOSE("metadata cache: {} hits, {} misses", cache->hits(), cache->misses());
+        if (fileInfoMap.empty())
+        {
+            continue;
+        }
+        log->info("{} files changed", fileInfoMap.size());
+        fetchFiles(clients);
+        synced = std::move(listing);
     }
 
-    for(int i = 0; i < 4; i++){
-        log->info("shortestRTT[{}] : {}", i, shortestRTT[i]);
+    // Delete the clients
+    for (int i = 0; i < num_servers; ++i)
+    {
+        log->info("Tearing down client {}", i);
+        delete clients[i];
     }
 
+    trace_stop();
+}
+
+// fetches the blocks of every file in fileInfoMap from the servers holding
+// them and writes the files out
+void Downloader::fetchFiles(vector<rpc::client*>& clients)
+{
+    auto log = logger();
+
     // Get list of blocks on num_servers
+    vector<unordered_set<string>> inventory(num_servers);
     for (int i = 0; i < num_servers; i++){
         try{
-            // stores hashmap lists in order
-            blockStores.push_back(clients[shortestRTT[i]]->call("get_all_blocks").as<unordered_map<string, string>>());
+            vector<string> hashes = clients[i]->call("get_block_list").as<vector<string>>();
+            inventory[i].insert(hashes.begin(), hashes.end());
         } catch (rpc::rpc_error) {
             log->error("Error getting blocks from server {}", i);
         }
     }
 
+    // every block is fetched from all replicas that hold it, in proportion
+    // to how fast each one delivers
+    FetchScheduler scheduler(num_servers, load, blocksize);
+    for (auto file: fileInfoMap)
+    {
+        for (auto ref: get<1>(file.second))
+        {
+            // packed small files share one segment block
+            string hash = block_of(ref);
+            vector<int> replicas;
+            for (int i = 0; i < num_servers; i++)
+            {
+                if (inventory[i].count(hash) > 0)
+                {
+                    replicas.push_back(i);
+                }
+            }
+            scheduler.add(hash, replicas);
+        }
+    }
+
     // store blocks downloaded from servers in this unordered_map
     unordered_map<string, string> blockStore;
+    mutex storeLock;
 
-    start = chrono::system_clock::now();
+    chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
 
-    // loop through all files
-    for (auto file: fileInfoMap)
+    vector<thread> streams;
+    for (int i = 0; i < num_servers; i++)
+    {
+        for (int j = 0; j < streams_per_server; j++)
+        {
+            streams.push_back(thread(&Downloader::fetchStream, this, i,
+                        ref(scheduler), ref(blockStore), ref(storeLock)));
+        }
+    }
+    for (auto& stream: streams)
+    {
+        stream.join();
+    }
+
+    for (auto hash: scheduler.missing())
+    {
+        log->error("Block {} not found on any server", hash);
+    }
+
+    chrono::duration<double> elapsed_seconds = chrono::system_clock::now() - start;
+    log->error("download time: {}", elapsed_seconds.count());
+
+    writeFiles(blockStore);
+
+}
+
+// one download stream to `server`: fetch whatever the scheduler hands out
+// until nothing is left that this server can help with
+void Downloader::fetchStream(int server, FetchScheduler& scheduler,
+        unordered_map<string, string>& blockStore, mutex& storeLock)
+{
+    auto log = logger();
+
+    unique_ptr<rpc::client> client;
+    try {
+        client.reset(new rpc::client(ssdhosts[server], ssdports[server]));
+        client->set_timeout(RPC_TIMEOUT);
+    } catch (std::exception &e) {
+        log->error("Unable to connect to server {}: {}", server, e.what());
+        scheduler.abandon(server);
+        return;
+    }
+
+    string hash;
+    while (scheduler.next(server, hash))
     {
-        // loop through hash list of file
-        for (auto hash: get<1>(file.second))
+        string data;
+        TRACE_SPAN_AT(span, "get_block");
+        span.setPeer(server);
+        chrono::time_point<chrono::steady_clock> start = chrono::steady_clock::now();
+        try {
+            data = client->call("get_block", hash).as<string>();
+        } catch (std::exception &e) {
+            // also how the server reports a block it dropped since listing
+            log->error("Error downloading block from server {}: {}", server, e.what());
+            scheduler.failed(server, hash);
+            continue;
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        load.record(server, data.size(), elapsed.count());
+        span.setBytes(data.size());
+
+        LOG_VERBOSE("downloaded block from server {}", server);
+        if (scheduler.complete(server, hash))
         {
-            bool found = false;
-            // go through each server (in order)
-            for (int i = 0; i < 4; i++)
+            lock_guard<mutex> lock(storeLock);
+            blockStore[hash] = std::move(data);
+        }
+    }
+}
+
+// reassembles every file from its blocks, a window of files at a time, with
+// all of a window's writes in flight at once
+void Downloader::writeFiles(unordered_map<string, string>& blockStore)
+{
+    auto log = logger();
+
+    vector<FileInfoMap::const_iterator> files;
+    for (auto it = fileInfoMap.cbegin(); it != fileInfoMap.cend(); ++it)
+    {
+        files.push_back(it);
+    }
+
+    for (size_t first = 0; first < files.size(); first += FILE_WINDOW)
+    {
+        size_t count = min(FILE_WINDOW, files.size() - first);
+
+        // overwrite
+        vector<IORequest> opens;
+        for (size_t i = 0; i < count; i++)
+        {
+            opens.push_back(IORequest::open(base_dir + "/" + files[first + i]->first,
+                                            O_WRONLY | O_CREAT | O_TRUNC));
+        }
+        io->submit(opens);
+
+        vector<IORequest> writes;
+        for (size_t i = 0; i < count; i++)
+        {
+            int fd = (int) opens[i].result;
+            if (fd < 0)
+            {
+                log->error("Unable to create {}: {}", files[first + i]->first, strerror(-fd));
+                continue;
+            }
+
+            // loop through hash list
+            uint64_t pos = 0;
+            for (auto& hash: get<1>(files[first + i]->second))
             {
-                // loop through blocks in each server's blocks
-                for (auto hashServer: blockStores.at(i))
+                string segment;
+                size_t offset, length;
+                const char* data = nullptr;
+                if (parse_extent(hash, segment, offset, length))
                 {
-                    // same block
-                    if (!hash.compare(hashServer.first))
+                    // slice a packed file back out of its segment
+                    const string& block = blockStore[segment];
+                    if (offset + length <= block.size())
                     {
-                        log->info("downloading block from server {}", shortestRTT[i]);
-                        // download block from server
-                        blockStore[hash] = clients[shortestRTT[i]]->call("get_block", hash).as<string>();
-                        found = true;
-                        break;
+                        data = block.data() + offset;
                     }
                 }
-                if (found)
+                else
                 {
-                    found = false;
-                    break;
+                    const string& block = blockStore[hash];
+                    data = block.data();
+                    length = block.size();
                 }
+                if (data != nullptr && length > 0)
+                {
+                    writes.push_back(IORequest::write(fd, pos, data, length));
+                    pos += length;
+                }
+            }
+        }
+        io->submit(writes);
+
+        for (auto& w: writes)
+        {
+            if (w.result < 0 || (size_t) w.result != w.len)
+            {
+                log->error("Error writing a block: {}", w.result < 0 ? strerror((int) -w.result) : "short write");
+            }
+        }
+        for (auto& open: opens)
+        {
+            if (open.result >= 0)
+            {
+                close((int) open.result);
             }
         }
     }
+}
 
-    end = chrono::system_clock::now();
-    elapsed_seconds = (end - start);
-    log->error("download time: {}", elapsed_seconds.count());
+// scatter-gather listing of a sharded namespace: ask every server for its
+// shard and keep the newest version of each file, since a replica that
+// missed an update can still hold an older one
+FileInfoMap Downloader::listNamespace(vector<rpc::client*>& clients)
+{
+    auto log = logger();
 
-    // loop through all files
-    for (auto file: fileInfoMap)
+    vector<future<clmdep_msgpack::object_handle>> replies;
+    for (int i = 0; i < num_servers; i++)
     {
-        ofstream myfile;
-        string filepath = base_dir + "/" + file.first;
-        // overwrite
-        myfile.open(filepath, ios::trunc);
-
-        // loop through hash list
-        for (auto hash: get<1>(file.second))
-        {
-            // get block from blockStore, add to myfile
-            myfile << blockStore[hash];
-        }
-        myfile.close();
+        replies.push_back(clients[i]->async_call("get_fileinfo_map"));
     }
 
-    // Delete the clients
-    for (int i = 0; i < num_servers; ++i)
+    FileInfoMap merged;
+    for (int i = 0; i < num_servers; i++)
     {
-        log->info("Tearing down client {}", i);
-        delete clients[i];
+        try {
+            FileInfoMap shard = replies[i].get().as<FileInfoMap>();
+            for (auto& file: shard)
+            {
+                auto it = merged.find(file.first);
+                if (it == merged.end() || get<0>(it->second) < get<0>(file.second))
+                {
+                    merged[file.first] = file.second;
+                }
+            }
+        } catch (std::exception &e) {
+            log->error("Error retrieving file info map from server {}: {}", i, e.what());
+        }
     }
+    return merged;
 }
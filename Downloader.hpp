@@ -3,11 +3,17 @@
 
 #include <string>
 #include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <memory>
 
 #include "inih/INIReader.h"
 #include "rpc/client.h"
 
 #include "SurfStoreTypes.hpp"
+#include "ServerLoad.hpp"
+#include "FetchScheduler.hpp"
+#include "DiskIO.hpp"
 #include "logger.hpp"
 
 using namespace std;
@@ -22,17 +28,32 @@ public:
 
 protected:
 
+    FileInfoMap listNamespace(vector<rpc::client*>& clients);
+    void fetchFiles(vector<rpc::client*>& clients);
+    void fetchStream(int server, FetchScheduler& scheduler,
+            unordered_map<string, string>& blockStore, mutex& storeLock);
+    void writeFiles(unordered_map<string, string>& blockStore);
+
+    const size_t FILE_WINDOW = 256; // files open at once while writing
+
     INIReader& config;
 
 	string base_dir;
 	int blocksize;
 
 	int num_servers;
+	int metadata_replicas; // servers per metadata shard, 0 if unsharded
   int localserver;
 	vector<string> ssdhosts;
 	vector<int> ssdports;
 
+  int streams_per_server;
+  int follow_ms; // re-listing interval, 0 to download once
+  int io_depth; // file writes in flight
+  unique_ptr<DiskIO> io;
+
   FileInfoMap fileInfoMap;
+  ServerLoad load; // measured throughput per server
 };
 
 #endif // DOWNLOADER_HPP
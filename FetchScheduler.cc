@@ -0,0 +1,191 @@
+#include <algorithm>
+
+#include "FetchScheduler.hpp"
+
+using namespace std;
+
+FetchScheduler::FetchScheduler(int t_num_servers, ServerLoad& t_load, size_t t_blocksize)
+    : num_servers(t_num_servers), load(t_load), blocksize(t_blocksize),
+      queues(t_num_servers), held(t_num_servers), inflight(t_num_servers), remaining(0)
+{
+}
+
+void FetchScheduler::add(const string& hash, const vector<int>& replicas)
+{
+    lock_guard<mutex> guard(lock);
+    if (blocks.count(hash) > 0) {
+        return;
+    }
+
+    Pending& p = blocks[hash];
+    p.replicas = replicas;
+    p.done = replicas.empty();
+    p.lost = replicas.empty();
+    if (p.done) {
+        return;
+    }
+    remaining++;
+
+    // single-replica blocks to the front, so their only source starts on
+    // them while everyone else shares the rest
+    for (int server: replicas) {
+        held[server].insert(hash);
+        if (replicas.size() == 1) {
+            queues[server].push_front(hash);
+        } else {
+            queues[server].push_back(hash);
+        }
+    }
+}
+
+bool FetchScheduler::claim(int server, string& hash)
+{
+    deque<string>& queue = queues[server];
+    while (!queue.empty()) {
+        string candidate = queue.front();
+        queue.pop_front();
+
+        Pending& p = blocks[candidate];
+        if (p.done || !p.fetching.empty()) {
+            continue;
+        }
+        p.fetching.push_back(server);
+        for (int replica: p.replicas) {
+            inflight[replica].insert(candidate);
+        }
+        hash = candidate;
+        return true;
+    }
+    return false;
+}
+
+bool FetchScheduler::steal(int server, string& hash)
+{
+    double mine = load.estimate(server, blocksize);
+    double worst = mine;
+    string victim;
+
+    for (auto& candidate: inflight[server]) {
+        Pending& p = blocks[candidate];
+        if (find(p.fetching.begin(), p.fetching.end(), server) != p.fetching.end()) {
+            continue;
+        }
+
+        // how soon the quickest stream already on it should finish
+        double best = -1;
+        for (int other: p.fetching) {
+            double t = load.estimate(other, blocksize);
+            if (best < 0 || t < best) {
+                best = t;
+            }
+        }
+        if (best > worst) {
+            worst = best;
+            victim = candidate;
+        }
+    }
+
+    if (victim.empty()) {
+        return false;
+    }
+    blocks[victim].fetching.push_back(server);
+    hash = victim;
+    return true;
+}
+
+// whether `server` holds any block that is not finished yet
+bool FetchScheduler::useful(int server)
+{
+    return !held[server].empty();
+}
+
+// `hash` is finished, delivered or lost: no server is left to fetch it
+void FetchScheduler::settle(const string& hash, Pending& p)
+{
+    p.done = true;
+    remaining--;
+    for (int replica: p.replicas) {
+        held[replica].erase(hash);
+        inflight[replica].erase(hash);
+    }
+}
+
+bool FetchScheduler::next(int server, string& hash)
+{
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        if (remaining == 0) {
+            return false;
+        }
+        if (claim(server, hash) || steal(server, hash)) {
+            return true;
+        }
+        if (!useful(server)) {
+            return false;
+        }
+        changed.wait(guard);
+    }
+}
+
+bool FetchScheduler::complete(int server, const string& hash)
+{
+    lock_guard<mutex> guard(lock);
+    Pending& p = blocks[hash];
+    p.fetching.erase(remove(p.fetching.begin(), p.fetching.end(), server), p.fetching.end());
+    if (p.done) {
+        return false;
+    }
+    settle(hash, p);
+    changed.notify_all();
+    return true;
+}
+
+// `server` will not deliver `hash`; call with the lock held
+void FetchScheduler::drop(int server, const string& hash, Pending& p)
+{
+    p.fetching.erase(remove(p.fetching.begin(), p.fetching.end(), server), p.fetching.end());
+    p.replicas.erase(remove(p.replicas.begin(), p.replicas.end(), server), p.replicas.end());
+    held[server].erase(hash);
+    inflight[server].erase(hash);
+
+    if (!p.done && p.replicas.empty()) {
+        p.lost = true;
+        settle(hash, p);
+    } else if (!p.done && p.fetching.empty()) {
+        // hand it back to the remaining replicas
+        for (int other: p.replicas) {
+            inflight[other].erase(hash);
+            queues[other].push_front(hash);
+        }
+    }
+}
+
+void FetchScheduler::failed(int server, const string& hash)
+{
+    lock_guard<mutex> guard(lock);
+    drop(server, hash, blocks[hash]);
+    changed.notify_all();
+}
+
+void FetchScheduler::abandon(int server)
+{
+    lock_guard<mutex> guard(lock);
+    queues[server].clear();
+    vector<string> hashes(held[server].begin(), held[server].end());
+    for (auto& hash: hashes) {
+        drop(server, hash, blocks[hash]);
+    }
+    changed.notify_all();
+}
+
+vector<string> FetchScheduler::missing()
+{
+    lock_guard<mutex> guard(lock);
+    vector<string> lost;
+    for (auto& entry: blocks) {
+        if (entry.second.lost) {
+            lost.push_back(entry.first);
+        }
+    }
+    return lost;
+}
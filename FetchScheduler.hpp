@@ -0,0 +1,69 @@
+#ifndef FETCHSCHEDULER_HPP
+#define FETCHSCHEDULER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+
+#include "ServerLoad.hpp"
+
+using namespace std;
+
+// Hands out block fetches to per-server download streams. Streams pull work,
+// so each replica's share follows how fast it actually delivers. Blocks with
+// the fewest replicas go first, and once a stream runs out of unclaimed
+// blocks it steals in-flight ones from sources the ServerLoad estimates say
+// are slower; the first copy to arrive wins.
+class FetchScheduler {
+public:
+    FetchScheduler(int t_num_servers, ServerLoad& t_load, size_t t_blocksize);
+
+    void add(const string& hash, const vector<int>& replicas);
+
+    // blocks until there is a block for `server` to fetch; false once there
+    // is nothing left it could help with
+    bool next(int server, string& hash);
+
+    // true if this was the first copy of the block to arrive
+    bool complete(int server, const string& hash);
+    void failed(int server, const string& hash);
+    // `server` can't be reached: every block it was to deliver goes back to
+    // the other replicas, or is lost if it had none
+    void abandon(int server);
+
+    vector<string> missing(); // blocks no replica could deliver
+
+protected:
+    struct Pending {
+        vector<int> replicas;
+        vector<int> fetching;
+        bool done;
+        bool lost;
+    };
+
+    bool claim(int server, string& hash);
+    bool steal(int server, string& hash);
+    bool useful(int server);
+    void drop(int server, const string& hash, Pending& p);
+    void settle(const string& hash, Pending& p);
+
+    const int num_servers;
+    ServerLoad& load;
+    const size_t blocksize;
+
+    mutex lock;
+    condition_variable changed;
+    unordered_map<string, Pending> blocks;
+    vector<deque<string>> queues; // unclaimed blocks each server holds
+    // per server, so idle streams never scan every block: the unfinished
+    // blocks it holds, and those of them some stream is fetching
+    vector<unordered_set<string>> held;
+    vector<unordered_set<string>> inflight;
+    size_t remaining;
+};
+
+#endif // FETCHSCHEDULER_HPP
@@ -0,0 +1,259 @@
+#include <string>
+#include <vector>
+#include <future>
+#include <memory>
+
+#include "rpc/client.h"
+#include "rpc/rpc_error.h"
+
+#include "logger.hpp"
+#include "Placement.hpp"
+#include "MetadataCache.hpp"
+
+using namespace std;
+
+MetadataCache::MetadataCache(const vector<string>& t_hosts, const vector<int>& t_ports,
+                             int t_metadata_replicas, int t_home)
+    : hosts(t_hosts), ports(t_ports), metadata_replicas(t_metadata_replicas), home(t_home),
+      shards(t_hosts.size()), epochs(t_hosts.size(), 0), seqs(t_hosts.size(), 0), watching(t_hosts.size(), false),
+      running(true), cacheHits(0), cacheMisses(0)
+{
+    for (auto& shard: shards) {
+        shard.valid = false;
+    }
+}
+
+MetadataCache::~MetadataCache()
+{
+    running = false;
+    for (auto& watcher: watchers) {
+        watcher.join();
+    }
+}
+
+int MetadataCache::owner(const string& filename)
+{
+    if (metadata_replicas <= 0) {
+        return home;
+    }
+    return metadata_owners(filename, (int) hosts.size(), metadata_replicas)[0];
+}
+
+// when a lease granted at `seq` of `epoch` ends; call with the lock held. A
+// grant older than what the watcher has already seen may have missed an
+// invalidation, and one from another run of the server than the watcher
+// follows can't be ordered against it, so neither is cached at all.
+MetadataCache::clock::time_point MetadataCache::leaseEnd(int server, uint64_t epoch, uint64_t seq,
+                                                         int lease_ms)
+{
+    clock::time_point now = clock::now();
+    if (epoch != epochs[server] || seq < seqs[server]) {
+        return now;
+    }
+    return now + chrono::milliseconds(lease_ms);
+}
+
+FileInfo MetadataCache::fileVersion(const string& filename)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = entries.find(filename);
+        if (it != entries.end() && it->second.expires > clock::now()) {
+            cacheHits++;
+            return it->second.info;
+        }
+    }
+    cacheMisses++;
+
+    int server = owner(filename);
+    rpc::client client(hosts[server], ports[server]);
+    client.set_timeout(RPC_TIMEOUT);
+    tuple<uint64_t, uint64_t, int, FileInfo> lease =
+        client.call("lease_file", filename).as<tuple<uint64_t, uint64_t, int, FileInfo>>();
+
+    lock_guard<mutex> guard(lock);
+    watchFrom(server, get<0>(lease), get<1>(lease));
+    Entry& entry = entries[filename];
+    entry.info = get<3>(lease);
+    entry.server = server;
+    entry.expires = leaseEnd(server, get<0>(lease), get<1>(lease), get<2>(lease));
+    return entry.info;
+}
+
+FileInfoMap MetadataCache::listing()
+{
+    // a sharded namespace is the union of every server's shard
+    vector<int> servers;
+    if (metadata_replicas <= 0) {
+        servers.push_back(home);
+    } else {
+        for (int i = 0; i < (int) hosts.size(); i++) {
+            servers.push_back(i);
+        }
+    }
+
+    vector<unique_ptr<rpc::client>> clients(hosts.size());
+    vector<future<clmdep_msgpack::object_handle>> replies(hosts.size());
+    {
+        lock_guard<mutex> guard(lock);
+        for (int i: servers) {
+            if (shards[i].valid && shards[i].expires > clock::now()) {
+                cacheHits++;
+                continue;
+            }
+            cacheMisses++;
+            shards[i].valid = false;
+            try {
+                clients[i].reset(new rpc::client(hosts[i], ports[i]));
+                clients[i]->set_timeout(RPC_TIMEOUT);
+                replies[i] = clients[i]->async_call("lease_fileinfo_map");
+            } catch (std::exception &e) {
+                logger()->error("Error retrieving file info map from server {}: {}", i, e.what());
+                clients[i].reset();
+            }
+        }
+    }
+
+    // a server that doesn't answer in time leaves its shard out of the
+    // listing; the timeout only bounds synchronous calls, so wait for these
+    // against a deadline of our own
+    clock::time_point deadline = clock::now() + chrono::milliseconds(RPC_TIMEOUT);
+    for (int i: servers) {
+        if (!clients[i]) {
+            continue;
+        }
+        tuple<uint64_t, uint64_t, int, FileInfoMap> lease;
+        try {
+            if (replies[i].wait_until(deadline) != future_status::ready) {
+                logger()->error("Timed out retrieving file info map from server {}", i);
+                continue;
+            }
+            lease = replies[i].get().as<tuple<uint64_t, uint64_t, int, FileInfoMap>>();
+        } catch (std::exception &e) {
+            logger()->error("Error retrieving file info map from server {}: {}", i, e.what());
+            continue;
+        }
+
+        lock_guard<mutex> guard(lock);
+        watchFrom(i, get<0>(lease), get<1>(lease));
+        clock::time_point expires = leaseEnd(i, get<0>(lease), get<1>(lease), get<2>(lease));
+        for (auto& file: get<3>(lease)) {
+            Entry& entry = entries[file.first];
+            entry.info = file.second;
+            entry.server = i;
+            entry.expires = expires;
+        }
+        shards[i].files = std::move(get<3>(lease));
+        shards[i].expires = expires;
+        shards[i].valid = true;
+    }
+
+    // keep the newest version where shard replicas disagree
+    FileInfoMap merged;
+    lock_guard<mutex> guard(lock);
+    for (int i: servers) {
+        if (!shards[i].valid) {
+            continue;
+        }
+        for (auto& file: shards[i].files) {
+            auto it = merged.find(file.first);
+            if (it == merged.end() || get<0>(it->second) < get<0>(file.second)) {
+                merged[file.first] = file.second;
+            }
+        }
+    }
+    return merged;
+}
+
+// start watching `server` from `seq` of `epoch` if nobody is yet; call with
+// the lock held
+void MetadataCache::watchFrom(int server, uint64_t epoch, uint64_t seq)
+{
+    if (watching[server]) {
+        return;
+    }
+    watching[server] = true;
+    epochs[server] = epoch;
+    seqs[server] = seq;
+    watchers.push_back(thread(&MetadataCache::watch, this, server));
+}
+
+// forget everything leased from `server`; call with the lock held
+void MetadataCache::dropServer(int server)
+{
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (it->second.server == server) {
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    shards[server].valid = false;
+}
+
+void MetadataCache::watch(int server)
+{
+    auto log = logger();
+
+    unique_ptr<rpc::client> client;
+    while (running) {
+        uint64_t epoch, since;
+        {
+            lock_guard<mutex> guard(lock);
+            epoch = epochs[server];
+            since = seqs[server];
+        }
+
+        tuple<uint64_t, uint64_t, bool, vector<string>> reply;
+        clock::time_point start = clock::now();
+        try {
+            if (!client) {
+                client.reset(new rpc::client(hosts[server], ports[server]));
+            }
+            future<clmdep_msgpack::object_handle> pending =
+                client->async_call("watch", epoch, since, WATCH_MS);
+            // wait in slices so shutting down never waits out a long poll
+            while (running && pending.wait_for(chrono::milliseconds(100)) != future_status::ready) {
+            }
+            if (!running) {
+                break;
+            }
+            reply = pending.get().as<tuple<uint64_t, uint64_t, bool, vector<string>>>();
+        } catch (std::exception &e) {
+            // invalidations may have been missed while unreachable
+            log->info("Lost watch on server {}: {}", server, e.what());
+            {
+                lock_guard<mutex> guard(lock);
+                dropServer(server);
+            }
+            client.reset();
+            this_thread::sleep_for(chrono::milliseconds(500));
+            continue;
+        }
+
+        bool quiet;
+        {
+            lock_guard<mutex> guard(lock);
+            // a restarted server's sequence says nothing about ours, even
+            // if it didn't flag a reset
+            bool reset = get<2>(reply) || get<0>(reply) != epoch;
+            if (reset) {
+                dropServer(server);
+            } else if (!get<3>(reply).empty()) {
+                for (auto& name: get<3>(reply)) {
+                    entries.erase(name);
+                }
+                shards[server].valid = false;
+            }
+            epochs[server] = get<0>(reply);
+            seqs[server] = get<1>(reply);
+            quiet = !reset && get<3>(reply).empty();
+        }
+
+        // a server with all its watch slots taken answers at once instead
+        // of holding the poll; don't spin on it
+        if (quiet && clock::now() - start < chrono::milliseconds(WATCH_MS / 2)) {
+            this_thread::sleep_for(chrono::milliseconds(SHORT_POLL_MS));
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef METADATACACHE_HPP
+#define METADATACACHE_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+#include "SurfStoreTypes.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+// Client-side cache of file metadata held under server leases. Entries are
+// served locally until their lease runs out; a watcher thread per server
+// long-polls the watch rpc and drops entries as soon as they change there.
+// It only pays off in a client that stays up and repeats lookups, such as
+// the downloader in follow mode; a one-shot upload or download asks the
+// servers directly, since every lookup it makes would be a cold miss.
+class MetadataCache {
+public:
+    // `home` answers listings and lookups when metadata is not sharded
+    MetadataCache(const vector<string>& t_hosts, const vector<int>& t_ports,
+                  int t_metadata_replicas, int t_home);
+    ~MetadataCache();
+
+    FileInfo fileVersion(const string& filename);
+    FileInfoMap listing();
+
+    size_t hits() const { return cacheHits; }
+    size_t misses() const { return cacheMisses; }
+
+    const uint64_t RPC_TIMEOUT = 10000; // milliseconds
+    const int WATCH_MS = 5000; // long poll length asked of servers
+    const int SHORT_POLL_MS = 250; // poll interval when a server can't hold a poll
+
+protected:
+    typedef chrono::steady_clock clock;
+
+    struct Entry {
+        FileInfo info;
+        clock::time_point expires;
+        int server;
+    };
+    struct Shard {
+        FileInfoMap files;
+        clock::time_point expires;
+        bool valid;
+    };
+
+    int owner(const string& filename);
+    void watchFrom(int server, uint64_t epoch, uint64_t seq);
+    void watch(int server);
+    void dropServer(int server);
+    clock::time_point leaseEnd(int server, uint64_t epoch, uint64_t seq, int lease_ms);
+
+    vector<string> hosts;
+    vector<int> ports;
+    const int metadata_replicas;
+    const int home;
+
+    mutex lock;
+    unordered_map<string, Entry> entries;
+    vector<Shard> shards; // cached listing per server
+    vector<uint64_t> epochs; // run of each server the watcher follows
+    vector<uint64_t> seqs; // newest change each watcher has seen
+    vector<bool> watching;
+    vector<thread> watchers;
+    atomic<bool> running;
+
+    atomic<size_t> cacheHits;
+    atomic<size_t> cacheMisses;
+};
+
+#endif // METADATACACHE_HPP
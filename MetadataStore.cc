@@ -0,0 +1,575 @@
+#include <sysexits.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "logger.hpp"
+#include "MetadataStore.hpp"
+
+using namespace std;
+
+static const char SNAPSHOT_MAGIC[8] = {'S', 'S', 'M', 'E', 'T', 'A', '0', '1'};
+static const size_t SNAPSHOT_HEADER = 32;
+// entries copied per hold of the map lock while snapshotting
+static const size_t SNAPSHOT_CHUNK = 1024;
+// fewest entries worth a decoding thread of their own at startup
+static const uint64_t LOAD_SLICE = 65536;
+
+static uint32_t checksum(const char* p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char) p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+template <typename T>
+static void put_field(string& out, T v)
+{
+    out.append((const char*) &v, sizeof(v));
+}
+
+template <typename T>
+static bool get_field(const char*& p, const char* end, T& v)
+{
+    if ((size_t) (end - p) < sizeof(v)) {
+        return false;
+    }
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return true;
+}
+
+static void put_entry(string& out, const string& filename, const FileInfo& finfo)
+{
+    put_field<uint32_t>(out, (uint32_t) filename.size());
+    out.append(filename);
+    put_field<int32_t>(out, (int32_t) get<0>(finfo));
+    put_field<uint32_t>(out, (uint32_t) get<1>(finfo).size());
+    for (auto& hash: get<1>(finfo)) {
+        put_field<uint16_t>(out, (uint16_t) hash.size());
+        out.append(hash);
+    }
+}
+
+static bool get_entry(const char*& p, const char* end, string& filename, FileInfo& finfo)
+{
+    uint32_t namelen, count;
+    int32_t version;
+    if (!get_field(p, end, namelen) || (size_t) (end - p) < namelen) {
+        return false;
+    }
+    filename.assign(p, namelen);
+    p += namelen;
+    if (!get_field(p, end, version) || !get_field(p, end, count)) {
+        return false;
+    }
+
+    list<string> hashes;
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t len;
+        if (!get_field(p, end, len) || (size_t) (end - p) < len) {
+            return false;
+        }
+        hashes.push_back(string(p, len));
+        p += len;
+    }
+    finfo = make_tuple((int) version, std::move(hashes));
+    return true;
+}
+
+static bool write_all(int fd, const char* p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+MetadataStore::MetadataStore(INIReader& t_config, int t_servernum)
+    : config(t_config), servernum(t_servernum), walfd(-1), walgen(0), walrecords(0),
+      appended(0), durable(0), syncing(false), running(false)
+{
+    auto log = logger();
+
+    string base = config.Get("ssd", "meta_dir", "");
+    if (base == "") {
+        log->info("Metadata persistence disabled");
+        return;
+    }
+
+    snapshot_interval = (int) config.GetInteger("ssd", "snapshot_interval", 300);
+    if (snapshot_interval <= 0) {
+        log->error("Invalid snapshot interval: {}", snapshot_interval);
+        exit(EX_CONFIG);
+    }
+    wal_sync = config.GetBoolean("ssd", "wal_sync", true);
+
+    dir = base + "/server" + std::to_string(servernum);
+    if ((mkdir(base.c_str(), 0755) < 0 && errno != EEXIST) ||
+        (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)) {
+        log->error("Unable to create metadata directory {}: {}", dir, strerror(errno));
+        exit(EX_CANTCREAT);
+    }
+    log->info("Persisting metadata in {}", dir);
+}
+
+MetadataStore::~MetadataStore()
+{
+    stop();
+    if (walfd >= 0) {
+        unique_lock<mutex> wal(walLock);
+        flush(wal);
+        close(walfd);
+    }
+}
+
+string MetadataStore::logPath(uint64_t generation)
+{
+    return dir + "/wal." + std::to_string(generation);
+}
+
+vector<uint64_t> MetadataStore::logGenerations()
+{
+    vector<uint64_t> gens;
+    DIR* dirp = opendir(dir.c_str());
+    if (dirp == NULL) {
+        return gens;
+    }
+    struct dirent * dp;
+    while ((dp = readdir(dirp)) != NULL) {
+        string name(dp->d_name);
+        if (name.compare(0, 4, "wal.") == 0 && name.size() > 4) {
+            gens.push_back(strtoull(name.c_str() + 4, nullptr, 10));
+        }
+    }
+    closedir(dirp);
+    sort(gens.begin(), gens.end());
+    return gens;
+}
+
+bool MetadataStore::loadSnapshot(FileInfoMap& fileMap, uint64_t& generation)
+{
+    auto log = logger();
+
+    string path = dir + "/snapshot";
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < SNAPSHOT_HEADER) {
+        close(fd);
+        log->error("Snapshot {} is truncated", path);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        log->error("Unable to map snapshot {}: {}", path, strerror(errno));
+        return false;
+    }
+    madvise(mapped, size, MADV_WILLNEED);
+
+    const char* base = (const char*) mapped;
+    const char* p = base;
+    const char* end = p + size;
+    uint64_t count, indexoff;
+    bool ok = memcmp(p, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+    p += sizeof(SNAPSHOT_MAGIC);
+    ok = ok && get_field(p, end, generation) && get_field(p, end, count) && get_field(p, end, indexoff);
+    ok = ok && indexoff >= SNAPSHOT_HEADER && indexoff <= size &&
+         (size - indexoff) / sizeof(uint64_t) >= count;
+
+    // the index splits the entries into slices decoded in parallel; a
+    // slice's entries must fill exactly the bytes up to the next one
+    vector<uint64_t> offsets;
+    if (ok) {
+        offsets.resize(count + 1);
+        memcpy(offsets.data(), base + indexoff, count * sizeof(uint64_t));
+        offsets[count] = indexoff;
+        ok = count == 0 || offsets[0] == SNAPSHOT_HEADER;
+    }
+    size_t slices = 1;
+    if (ok) {
+        size_t cores = max(1u, thread::hardware_concurrency());
+        slices = (size_t) max((uint64_t) 1, min((uint64_t) cores, count / LOAD_SLICE));
+    }
+    vector<vector<pair<string, FileInfo>>> decoded(slices);
+    vector<char> sliceOk(slices, 1);
+    auto decode = [&](size_t s) {
+        uint64_t first = count * s / slices;
+        uint64_t last = count * (s + 1) / slices;
+        decoded[s].reserve(last - first);
+        for (uint64_t i = first; i < last; i++) {
+            if (offsets[i + 1] < offsets[i] || offsets[i + 1] > indexoff) {
+                sliceOk[s] = 0;
+                return;
+            }
+            const char* q = base + offsets[i];
+            const char* next = base + offsets[i + 1];
+            string filename;
+            FileInfo finfo;
+            if (!get_entry(q, next, filename, finfo) || q != next) {
+                sliceOk[s] = 0;
+                return;
+            }
+            decoded[s].push_back(make_pair(std::move(filename), std::move(finfo)));
+        }
+    };
+    if (ok) {
+        vector<thread> decoders;
+        for (size_t s = 1; s < slices; s++) {
+            decoders.push_back(thread(decode, s));
+        }
+        decode(0);
+        for (auto& decoder: decoders) {
+            decoder.join();
+        }
+        ok = find(sliceOk.begin(), sliceOk.end(), 0) == sliceOk.end();
+    }
+    munmap(mapped, size);
+
+    // entries are in filename order, so each insert lands at the end
+    for (size_t s = 0; ok && s < slices; s++) {
+        for (auto& entry: decoded[s]) {
+            fileMap.emplace_hint(fileMap.end(), std::move(entry.first), std::move(entry.second));
+        }
+        decoded[s].clear();
+    }
+
+    if (!ok) {
+        log->error("Snapshot {} is corrupt, ignoring it", path);
+        fileMap.clear();
+        generation = 0;
+        return false;
+    }
+    log->info("Loaded {} files from snapshot with {} threads", count, slices);
+    return true;
+}
+
+void MetadataStore::replay(const string& path, FileInfoMap& fileMap)
+{
+    auto log = logger();
+
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return;
+    }
+
+    string buf(st.st_size, '\0');
+    size_t got = 0;
+    while (got < buf.size()) {
+        ssize_t r = read(fd, &buf[got], buf.size() - got);
+        if (r <= 0) {
+            break;
+        }
+        got += r;
+    }
+    buf.resize(got);
+
+    const char* p = buf.data();
+    const char* end = p + buf.size();
+    size_t records = 0;
+    for (;;) {
+        const char* start = p;
+        uint32_t len, sum;
+        if (!get_field(p, end, len) || !get_field(p, end, sum) || (size_t) (end - p) < len ||
+            checksum(p, len) != sum) {
+            // a torn tail from a crash mid-append: cut it off
+            if (start != end) {
+                log->error("Truncating {} at a torn record", path);
+                if (ftruncate(fd, start - buf.data()) < 0) {
+                    log->error("Unable to truncate {}: {}", path, strerror(errno));
+                }
+            }
+            break;
+        }
+
+        const char* rec = p;
+        string filename;
+        FileInfo finfo;
+        if (get_entry(rec, p + len, filename, finfo)) {
+            fileMap[filename] = std::move(finfo);
+            records++;
+        }
+        p += len;
+    }
+    close(fd);
+    log->info("Replayed {} updates from {}", records, path);
+}
+
+// makes creates and renames in the metadata directory durable
+bool MetadataStore::syncDir()
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// switches to a new log; call with walLock held and nothing queued
+void MetadataStore::openLog(uint64_t generation)
+{
+    auto log = logger();
+
+    int fd = open(logPath(generation).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    // records synced into the log are only safe once its name is
+    if (fd < 0 || !syncDir()) {
+        log->error("Unable to open write-ahead log {}: {}", logPath(generation), strerror(errno));
+        exit(EX_CANTCREAT);
+    }
+    if (walfd >= 0) {
+        close(walfd);
+    }
+    walfd = fd;
+    walgen = generation;
+    walrecords = 0;
+}
+
+void MetadataStore::recover(FileInfoMap& fileMap)
+{
+    if (!enabled()) {
+        return;
+    }
+
+    uint64_t generation = 0;
+    loadSnapshot(fileMap, generation);
+
+    // logs older than the snapshot are already folded into it
+    uint64_t last = generation;
+    for (uint64_t gen: logGenerations()) {
+        if (gen < generation) {
+            unlink(logPath(gen).c_str());
+            continue;
+        }
+        replay(logPath(gen), fileMap);
+        last = gen;
+
+        // restarts without updates leave empty logs behind
+        struct stat st;
+        if (stat(logPath(gen).c_str(), &st) == 0 && st.st_size == 0) {
+            unlink(logPath(gen).c_str());
+        }
+    }
+
+    // new updates go to a fresh log after everything replayed
+    lock_guard<mutex> lock(walLock);
+    openLog(last + 1);
+}
+
+uint64_t MetadataStore::append(const string& filename, const FileInfo& finfo)
+{
+    if (!enabled()) {
+        return 0;
+    }
+
+    string entry;
+    put_entry(entry, filename, finfo);
+
+    lock_guard<mutex> lock(walLock);
+    put_field<uint32_t>(queued, (uint32_t) entry.size());
+    put_field<uint32_t>(queued, checksum(entry.data(), entry.size()));
+    queued.append(entry);
+    walrecords++;
+    return ++appended;
+}
+
+void MetadataStore::commit(uint64_t ticket)
+{
+    unique_lock<mutex> lock(walLock);
+    while (durable < ticket) {
+        if (syncing) {
+            synced.wait(lock);
+            continue;
+        }
+
+        // lead a group: write everything queued so far with one sync
+        string batch;
+        batch.swap(queued);
+        uint64_t upto = appended;
+        syncing = true;
+        lock.unlock();
+
+        if (!write_all(walfd, batch.data(), batch.size()) || (wal_sync && fdatasync(walfd) < 0)) {
+            auto log = logger();
+            log->error("Write-ahead log append failed: {}", strerror(errno));
+            exit(EX_IOERR);
+        }
+
+        lock.lock();
+        durable = upto;
+        syncing = false;
+        synced.notify_all();
+    }
+}
+
+// writes and syncs whatever is queued; `lock` holds walLock
+void MetadataStore::flush(unique_lock<mutex>& lock)
+{
+    synced.wait(lock, [this]() { return !syncing; });
+    if (!write_all(walfd, queued.data(), queued.size()) || (wal_sync && fdatasync(walfd) < 0)) {
+        auto log = logger();
+        log->error("Write-ahead log append failed: {}", strerror(errno));
+        exit(EX_IOERR);
+    }
+    queued.clear();
+    durable = appended;
+    synced.notify_all();
+}
+
+void MetadataStore::snapshot(FileInfoMap& fileMap, mutex& mapLock)
+{
+    auto log = logger();
+
+    // switch logs first: every update from here on is in the new log, and
+    // replaying it over the snapshot is right whether or not the copy
+    // below already saw the update
+    uint64_t generation;
+    {
+        lock_guard<mutex> lock(mapLock);
+        unique_lock<mutex> wal(walLock);
+        if (walrecords == 0) {
+            return;
+        }
+        // what is queued belongs to the old log
+        flush(wal);
+        openLog(walgen + 1);
+        generation = walgen;
+    }
+
+    string tmppath = dir + "/snapshot.tmp";
+    int fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log->error("Unable to write snapshot {}: {}", tmppath, strerror(errno));
+        return;
+    }
+
+    string buf(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    put_field<uint64_t>(buf, generation);
+    put_field<uint64_t>(buf, 0); // entry count, patched below
+    put_field<uint64_t>(buf, 0); // index offset, patched below
+
+    // serialize a chunk of entries per hold of the map lock, so metadata
+    // rpcs only ever wait for one chunk
+    uint64_t count = 0;
+    uint64_t written = 0;
+    vector<uint64_t> offsets;
+    string last;
+    bool more = true;
+    bool ok = true;
+    while (ok && more) {
+        {
+            lock_guard<mutex> lock(mapLock);
+            auto it = count == 0 ? fileMap.begin() : fileMap.upper_bound(last);
+            for (size_t n = 0; it != fileMap.end() && n < SNAPSHOT_CHUNK; ++it, ++n) {
+                offsets.push_back(written + buf.size());
+                put_entry(buf, it->first, it->second);
+                count++;
+            }
+            more = it != fileMap.end();
+            if (more) {
+                last = prev(it)->first;
+            }
+        }
+        if (buf.size() >= (1 << 20) || !more) {
+            ok = write_all(fd, buf.data(), buf.size());
+            written += buf.size();
+            buf.clear();
+        }
+    }
+    uint64_t indexoff = written;
+    for (uint64_t off: offsets) {
+        put_field<uint64_t>(buf, off);
+    }
+    uint64_t header[2] = { count, indexoff };
+    ok = ok && write_all(fd, buf.data(), buf.size());
+    ok = ok && pwrite(fd, header, sizeof(header), SNAPSHOT_HEADER - sizeof(header)) ==
+               (ssize_t) sizeof(header);
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmppath.c_str(), (dir + "/snapshot").c_str()) < 0) {
+        log->error("Snapshot failed: {}", strerror(errno));
+        unlink(tmppath.c_str());
+        return;
+    }
+
+    // the rename must be durable before the logs it replaces go away
+    if (!syncDir()) {
+        log->error("Unable to sync {}, keeping old logs: {}", dir, strerror(errno));
+        return;
+    }
+
+    for (uint64_t gen: logGenerations()) {
+        if (gen < generation) {
+            unlink(logPath(gen).c_str());
+        }
+    }
+    log->info("Wrote snapshot of {} files", count);
+}
+
+void MetadataStore::start(FileInfoMap& fileMap, mutex& mapLock)
+{
+    if (!enabled()) {
+        return;
+    }
+    running = true;
+    worker = thread(&MetadataStore::run, this, &fileMap, &mapLock);
+}
+
+void MetadataStore::stop()
+{
+    {
+        lock_guard<mutex> lock(waitLock);
+        running = false;
+    }
+    wakeup.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void MetadataStore::run(FileInfoMap* fileMap, mutex* mapLock)
+{
+    while (running) {
+        {
+            unique_lock<mutex> lock(waitLock);
+            wakeup.wait_for(lock, chrono::seconds(snapshot_interval),
+                            [this]() { return !running; });
+        }
+        if (!running) {
+            break;
+        }
+        snapshot(*fileMap, *mapLock);
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef METADATASTORE_HPP
+#define METADATASTORE_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdint.h>
+
+#include "inih/INIReader.h"
+
+#include "SurfStoreTypes.hpp"
+#include "logger.hpp"
+
+using namespace std;
+
+// Durable fileMap: every accepted update_file is appended to a write-ahead
+// log, and a background thread periodically writes a compact snapshot and
+// starts a new log. Startup maps the newest snapshot and replays the logs
+// written since.
+//
+// Appends only queue the record, under the map lock; commit() then writes
+// and syncs outside it. Whichever committer finds no sync running writes
+// everything queued so far with one fdatasync, and the rest wait for it, so
+// concurrent updates share a sync and metadata rpcs never wait on the disk
+// while holding the map lock. An update is visible in fileMap before its
+// commit returns, but its rpc is only answered after.
+//
+// Layout under <meta_dir>/server<N>/:
+//   snapshot   "SSMETA01", u64 first log generation, u64 entry count,
+//              u64 index offset, the entries sorted by filename, then a
+//              u64 file offset per entry, which lets startup split the
+//              entries between decoding threads
+//   wal.<gen>  records of u32 length, u32 checksum, one entry
+// An entry is u32 name length, name, i32 version, u32 hash count and a
+// u16 length plus bytes per hash.
+class MetadataStore {
+public:
+    MetadataStore(INIReader& t_config, int t_servernum);
+    ~MetadataStore();
+
+    bool enabled() const { return dir != ""; }
+
+    // fill fileMap from disk; call before serving
+    void recover(FileInfoMap& fileMap);
+    // queue the new state of one file for the log; call with the map lock
+    // held. Returns a ticket for commit(), 0 when persistence is off.
+    uint64_t append(const string& filename, const FileInfo& finfo);
+    // wait until everything up to `ticket` is in the log (and synced with
+    // wal_sync); call without the map lock
+    void commit(uint64_t ticket);
+
+    void start(FileInfoMap& fileMap, mutex& mapLock);
+    void stop();
+    void snapshot(FileInfoMap& fileMap, mutex& mapLock);
+
+protected:
+    void run(FileInfoMap* fileMap, mutex* mapLock);
+    bool loadSnapshot(FileInfoMap& fileMap, uint64_t& generation);
+    void replay(const string& path, FileInfoMap& fileMap);
+    void openLog(uint64_t generation);
+    void flush(unique_lock<mutex>& lock);
+    bool syncDir();
+    vector<uint64_t> logGenerations();
+    string logPath(uint64_t generation);
+
+    INIReader& config;
+    const int servernum;
+
+    string dir;
+    int snapshot_interval; // seconds
+    bool wal_sync;
+
+    int walfd;
+    uint64_t walgen;
+    size_t walrecords; // appended since the last snapshot
+
+    mutex walLock; // guards the group commit state below
+    condition_variable synced;
+    string queued; // records appended but not yet written
+    uint64_t appended; // tickets handed out
+    uint64_t durable; // tickets written (and synced)
+    bool syncing; // a committer is writing outside walLock
+
+    thread worker;
+    atomic<bool> running;
+    mutex waitLock;
+    condition_variable wakeup;
+};
+
+#endif // METADATASTORE_HPP
@@ -0,0 +1,65 @@
+#ifndef PLACEMENT_HPP
+#define PLACEMENT_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+using namespace std;
+
+// FNV-1a, so every process (servers and clients) agrees on placement
+inline uint64_t placement_hash(const string& key, int server)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); i++) {
+        h ^= (unsigned char) key[i];
+        h *= 1099511628211ULL;
+    }
+    for (int i = 0; i < 4; i++) {
+        h ^= (unsigned char) ((server >> (8 * i)) & 0xff);
+        h *= 1099511628211ULL;
+    }
+    // final avalanche so neighbouring server ids spread out
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// rendezvous (highest random weight) hashing: returns the `count` servers
+// out of `members` that own `key`, best first. Only keys owned by a server
+// that leaves or joins move, so membership changes shuffle as little as possible.
+inline vector<int> rendezvous_owners(const string& key, const vector<int>& members, int count)
+{
+    vector<pair<uint64_t, int>> scored;
+    for (int m: members) {
+        scored.push_back(make_pair(placement_hash(key, m), m));
+    }
+    sort(scored.begin(), scored.end(),
+         [](const pair<uint64_t, int>& a, const pair<uint64_t, int>& b) {
+             return a.first > b.first || (a.first == b.first && a.second < b.second);
+         });
+
+    vector<int> owners;
+    for (size_t i = 0; i < scored.size() && (int) owners.size() < count; i++) {
+        owners.push_back(scored[i].second);
+    }
+    return owners;
+}
+
+// servers holding the metadata of `filename`. With metadata sharding off
+// (replicas <= 0) every server holds every file.
+inline vector<int> metadata_owners(const string& filename, int num_servers, int replicas)
+{
+    vector<int> all;
+    for (int i = 0; i < num_servers; i++) {
+        all.push_back(i);
+    }
+    if (replicas <= 0 || replicas >= num_servers) {
+        return all;
+    }
+    return rendezvous_owners(filename, all, replicas);
+}
+
+#endif // PLACEMENT_HPP
@@ -0,0 +1,306 @@
+#include <sysexits.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "rpc/client.h"
+#include "rpc/rpc_error.h"
+
+#include "logger.hpp"
+#include "Placement.hpp"
+#include "Replicator.hpp"
+
+using namespace std;
+
+Replicator::Replicator(INIReader& t_config, int t_servernum,
+                       unordered_map<string, BlockBuffer>& t_blockStore, mutex& t_storeLock)
+    : config(t_config), servernum(t_servernum),
+      blockStore(t_blockStore), storeLock(t_storeLock), running(false)
+{
+    auto log = logger();
+
+    replication_factor = (int) config.GetInteger("ssd", "replication_factor", 0);
+    repair_interval = (int) config.GetInteger("ssd", "repair_interval", 30);
+    if (repair_interval <= 0) {
+        log->error("Invalid repair interval: {}", repair_interval);
+        exit(EX_CONFIG);
+    }
+    repair_bandwidth = config.GetReal("ssd", "repair_bandwidth", 0);
+    if (repair_bandwidth < 0) {
+        log->error("Invalid repair bandwidth: {}", repair_bandwidth);
+        exit(EX_CONFIG);
+    }
+    rebalance = config.GetBoolean("ssd", "rebalance", true);
+
+    num_servers = (int) config.GetInteger("ssd", "num_servers", -1);
+    if (num_servers <= 0) {
+        log->error("num_servers {} is invalid", num_servers);
+        exit(EX_CONFIG);
+    }
+    if (replication_factor > num_servers) {
+        log->error("replication_factor {} is larger than num_servers {}",
+                   replication_factor, num_servers);
+        exit(EX_CONFIG);
+    }
+
+    for (int i = 0; i < num_servers; ++i) {
+        string servconf = config.Get("ssd", "server"+std::to_string(i), "");
+        if (servconf == "") {
+            log->error("Server {} not found in config file", i);
+            exit(EX_CONFIG);
+        }
+        size_t idx = servconf.find(":");
+        if (idx == string::npos) {
+            log->error("Config line {} is invalid", servconf);
+            exit(EX_CONFIG);
+        }
+        string host = servconf.substr(0, idx);
+        int port = (int) strtol(servconf.substr(idx+1).c_str(), nullptr, 0);
+        if (port <= 0 || port > 65535) {
+            log->error("Invalid port number: {}", servconf);
+            exit(EX_CONFIG);
+        }
+        ssdhosts.push_back(host);
+        ssdports.push_back(port);
+    }
+
+    nextSend = chrono::steady_clock::now();
+}
+
+Replicator::~Replicator()
+{
+    stop();
+}
+
+void Replicator::start()
+{
+    auto log = logger();
+
+    if (replication_factor <= 0) {
+        log->info("Replication disabled");
+        return;
+    }
+    log->info("Replicating to {} servers every {}s, {} bytes/s", replication_factor,
+              repair_interval, repair_bandwidth);
+
+    running = true;
+    worker = thread(&Replicator::run, this);
+}
+
+void Replicator::stop()
+{
+    {
+        lock_guard<mutex> lock(waitLock);
+        running = false;
+    }
+    wakeup.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void Replicator::run()
+{
+    auto log = logger();
+
+    while (running) {
+        {
+            unique_lock<mutex> lock(waitLock);
+            wakeup.wait_for(lock, chrono::seconds(repair_interval),
+                            [this]() { return !running; });
+        }
+        if (!running) {
+            break;
+        }
+
+        try {
+            repair();
+        } catch (std::exception &e) {
+            log->error("Repair pass failed: {}", e.what());
+        }
+    }
+}
+
+vector<int> Replicator::view()
+{
+    lock_guard<mutex> lock(viewLock);
+    return liveView;
+}
+
+// token bucket: block until `bytes` more fit under repair_bandwidth
+void Replicator::throttle(size_t bytes)
+{
+    if (repair_bandwidth <= 0) {
+        return;
+    }
+
+    auto now = chrono::steady_clock::now();
+    if (nextSend < now) {
+        nextSend = now;
+    }
+    auto wait = nextSend - now;
+    nextSend += chrono::duration_cast<chrono::steady_clock::duration>(
+            chrono::duration<double>(bytes / repair_bandwidth));
+    if (wait > chrono::steady_clock::duration::zero()) {
+        this_thread::sleep_for(wait);
+    }
+}
+
+void Replicator::repair()
+{
+    auto log = logger();
+
+    // collect every live server's inventory, ours included
+    vector<unique_ptr<rpc::client>> clients(num_servers);
+    vector<unordered_set<string>> inventory(num_servers);
+    vector<int> live;
+
+    for (int i = 0; i < num_servers; ++i) {
+        if (i == servernum) {
+            lock_guard<mutex> lock(storeLock);
+            for (auto& block: blockStore) {
+                inventory[i].insert(block.first);
+            }
+            live.push_back(i);
+            continue;
+        }
+        try {
+            clients[i].reset(new rpc::client(ssdhosts[i], ssdports[i]));
+            clients[i]->set_timeout(RPC_TIMEOUT);
+            vector<string> hashes = clients[i]->call("get_block_list").as<vector<string>>();
+            inventory[i].insert(hashes.begin(), hashes.end());
+            live.push_back(i);
+        } catch (std::exception &e) {
+            log->info("Server {} unreachable, leaving it out of placement: {}", i, e.what());
+            clients[i].reset();
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(viewLock);
+        liveView = live;
+    }
+
+    // only rebalance when every live peer saw the same membership; a peer
+    // missing servers we see would place blocks elsewhere
+    bool agreed = rebalance;
+    for (int i: live) {
+        if (!agreed || i == servernum) {
+            continue;
+        }
+        try {
+            agreed = clients[i]->call("get_live_view").as<vector<int>>() == live;
+        } catch (std::exception &e) {
+            agreed = false;
+        }
+    }
+
+    int copies = min(replication_factor, (int) live.size());
+    size_t copied = 0;
+    vector<pair<string, vector<int>>> surplus;
+
+    for (const string& hash: inventory[servernum]) {
+        if (!running) {
+            return;
+        }
+
+        vector<int> owners = rendezvous_owners(hash, live, copies);
+
+        // the lowest-numbered live holder does the copying, so peers holding
+        // the same block don't all push it at once
+        int coordinator = servernum;
+        for (int i: live) {
+            if (inventory[i].count(hash) > 0) {
+                coordinator = i;
+                break;
+            }
+        }
+
+        bool owned = false;
+        bool complete = true;
+        for (int owner: owners) {
+            if (owner == servernum) {
+                owned = true;
+                continue;
+            }
+            if (inventory[owner].count(hash) > 0) {
+                continue;
+            }
+            if (coordinator != servernum) {
+                complete = false;
+                continue;
+            }
+
+            BlockBuffer data;
+            {
+                lock_guard<mutex> lock(storeLock);
+                auto it = blockStore.find(hash);
+                if (it == blockStore.end()) {
+                    complete = false;
+                    break;
+                }
+                data = it->second;
+            }
+
+            throttle(data.size());
+            try {
+                clients[owner]->call("store_block", hash, data);
+                inventory[owner].insert(hash);
+                copied++;
+            } catch (std::exception &e) {
+                log->error("Copying block to server {} failed: {}", owner, e.what());
+                complete = false;
+            }
+        }
+
+        // membership changed and this copy looks surplus: every owner has it
+        if (agreed && !owned && complete && (int) owners.size() == copies) {
+            surplus.push_back(make_pair(hash, owners));
+        }
+    }
+    size_t dropped = dropSurplus(surplus, clients);
+
+    log->info("Repair pass: {} live servers, {} blocks copied, {} blocks moved away",
+              live.size(), copied, dropped);
+}
+
+// drops the surplus copies every owner confirms holding right now; the
+// inventories may be stale by the end of a long pass
+size_t Replicator::dropSurplus(const vector<pair<string, vector<int>>>& surplus,
+                               vector<unique_ptr<rpc::client>>& clients)
+{
+    auto log = logger();
+
+    unordered_map<int, vector<string>> asks;
+    for (auto& block: surplus) {
+        for (int owner: block.second) {
+            asks[owner].push_back(block.first);
+        }
+    }
+
+    unordered_map<string, int> confirmed;
+    for (auto& ask: asks) {
+        try {
+            for (size_t start = 0; start < ask.second.size(); start += CONFIRM_BATCH) {
+                vector<string> batch(ask.second.begin() + start,
+                        ask.second.begin() + min(ask.second.size(), start + CONFIRM_BATCH));
+                vector<string> held = clients[ask.first]->call("has_blocks", batch).as<vector<string>>();
+                for (auto& hash: held) {
+                    confirmed[hash]++;
+                }
+            }
+        } catch (std::exception &e) {
+            log->error("Unable to confirm blocks on server {}: {}", ask.first, e.what());
+        }
+    }
+
+    size_t dropped = 0;
+    lock_guard<mutex> lock(storeLock);
+    for (auto& block: surplus) {
+        if (confirmed[block.first] == (int) block.second.size()) {
+            blockStore.erase(block.first);
+            dropped++;
+        }
+    }
+    return dropped;
+}
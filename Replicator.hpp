@@ -0,0 +1,77 @@
+#ifndef REPLICATOR_HPP
+#define REPLICATOR_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include "inih/INIReader.h"
+#include "rpc/client.h"
+
+#include "logger.hpp"
+#include "BlockBuffer.hpp"
+
+using namespace std;
+
+// Background server-to-server repair. Every repair_interval seconds the
+// replicator compares its block inventory with its peers', copies blocks to
+// the replication_factor servers that own them (rendezvous hashing over the
+// live members) and, when rebalancing is on, drops copies it no longer owns.
+// A copy is only dropped when every live server saw the same membership on
+// its last pass and every owner confirms it holds the block, so holders with
+// differing views never drop the last copies together.
+class Replicator {
+public:
+    Replicator(INIReader& t_config, int t_servernum,
+               unordered_map<string, BlockBuffer>& t_blockStore, mutex& t_storeLock);
+    ~Replicator();
+
+    void start();
+    void stop();
+
+    // the servers found live on the last repair pass
+    vector<int> view();
+
+    const uint64_t RPC_TIMEOUT = 10000; // milliseconds
+    const size_t CONFIRM_BATCH = 10000; // hashes per has_blocks call
+
+protected:
+    void run();
+    void repair();
+    void throttle(size_t bytes);
+    size_t dropSurplus(const vector<pair<string, vector<int>>>& surplus,
+                       vector<unique_ptr<rpc::client>>& clients);
+
+    INIReader& config;
+    const int servernum;
+
+    int num_servers;
+    vector<string> ssdhosts;
+    vector<int> ssdports;
+
+    int replication_factor;
+    int repair_interval;    // seconds
+    double repair_bandwidth; // bytes per second, 0 means unlimited
+    bool rebalance;
+
+    unordered_map<string, BlockBuffer>& blockStore;
+    mutex& storeLock;
+
+    thread worker;
+    atomic<bool> running;
+    mutex waitLock;
+    condition_variable wakeup;
+    chrono::steady_clock::time_point nextSend;
+
+    mutex viewLock;
+    vector<int> liveView; // guarded by viewLock
+};
+
+#endif // REPLICATOR_HPP
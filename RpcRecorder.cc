@@ -0,0 +1,68 @@
+#include <string>
+#include <sstream>
+
+#include "logger.hpp"
+#include "Placement.hpp"
+#include "RpcRecorder.hpp"
+
+using namespace std;
+
+bool parse_recorded_rpc(const string& line, RecordedRpc& out)
+{
+    if (line.empty() || line[0] == '#') {
+        return false;
+    }
+    istringstream in(line);
+    return (bool) (in >> out.start_us >> out.rpc >> out.key >> out.bytes >> out.dur_us);
+}
+
+RpcRecorder::RpcRecorder(const string& path)
+    : file(nullptr), begin(clock::now()), flushed(begin)
+{
+    // steady time after this, so stamps never step with the wall clock
+    begin_us = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    auto log = logger();
+
+    if (path.empty()) {
+        return;
+    }
+    file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        log->error("Unable to open rpc recording {}", path);
+        return;
+    }
+    fprintf(file, "# start_us\trpc\tkey\tbytes\tdur_us\n");
+    log->info("Recording rpcs to {}", path);
+}
+
+RpcRecorder::~RpcRecorder()
+{
+    if (file != nullptr) {
+        fclose(file);
+    }
+}
+
+string RpcRecorder::filename_key(const string& filename)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) placement_hash(filename, 0));
+    return buf;
+}
+
+void RpcRecorder::record(const char* rpc, const string& key, uint64_t bytes, clock::time_point start)
+{
+    clock::time_point now = clock::now();
+    unsigned long long start_us =
+        begin_us + chrono::duration_cast<chrono::microseconds>(start - begin).count();
+    unsigned long long dur_us = chrono::duration_cast<chrono::microseconds>(now - start).count();
+
+    lock_guard<mutex> guard(lock);
+    fprintf(file, "%llu\t%s\t%s\t%llu\t%llu\n", start_us, rpc, key.c_str(),
+            (unsigned long long) bytes, dur_us);
+    // the server is killed rather than stopped, so flush as we go
+    if (now - flushed > chrono::milliseconds(FLUSH_MS)) {
+        fflush(file);
+        flushed = now;
+    }
+}
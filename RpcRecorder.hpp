@@ -0,0 +1,94 @@
+#ifndef RPCRECORDER_HPP
+#define RPCRECORDER_HPP
+
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace std;
+
+// One line per rpc a server handled, tab separated:
+//   start_us  rpc  key  bytes  dur_us
+// start_us is wall clock time in microseconds since the Unix epoch, so the
+// recordings of several servers merge into one timeline. key is the block
+// hash, a hash of the filename for metadata rpcs, or "-". bytes is the
+// payload size, or the number of files or hashes for batch rpcs. The replay
+// tool reads these.
+struct RecordedRpc {
+    uint64_t start_us;
+    string rpc;
+    string key;
+    uint64_t bytes;
+    uint64_t dur_us;
+};
+
+bool parse_recorded_rpc(const string& line, RecordedRpc& out);
+
+class RpcRecorder {
+public:
+    typedef chrono::steady_clock clock;
+
+    // an empty path records nothing
+    explicit RpcRecorder(const string& path);
+    ~RpcRecorder();
+
+    bool enabled() const { return file != nullptr; }
+    void record(const char* rpc, const string& key, uint64_t bytes, clock::time_point start);
+
+    // filenames are recorded hashed, the replay only needs them distinct
+    static string filename_key(const string& filename);
+
+    const int FLUSH_MS = 1000;
+
+private:
+    RpcRecorder(const RpcRecorder&);
+    RpcRecorder& operator=(const RpcRecorder&);
+
+    FILE* file;
+    mutex lock;
+    clock::time_point begin;
+    uint64_t begin_us; // wall clock at `begin`
+    clock::time_point flushed;
+};
+
+// records the enclosing handler when it returns
+class RecordedCall {
+public:
+    RecordedCall(RpcRecorder& t_recorder, const char* t_rpc)
+        : recorder(t_recorder), rpc(t_rpc), bytes(0),
+          start(t_recorder.enabled() ? RpcRecorder::clock::now() : RpcRecorder::clock::time_point()) {}
+    ~RecordedCall()
+    {
+        if (recorder.enabled()) {
+            recorder.record(rpc, key.empty() ? "-" : key, bytes, start);
+        }
+    }
+
+    void setKey(const string& t_key)
+    {
+        if (recorder.enabled()) {
+            key = t_key;
+        }
+    }
+    void setFilename(const string& filename)
+    {
+        if (recorder.enabled()) {
+            key = RpcRecorder::filename_key(filename);
+        }
+    }
+    void setBytes(uint64_t t_bytes) { bytes = t_bytes; }
+
+private:
+    RecordedCall(const RecordedCall&);
+    RecordedCall& operator=(const RecordedCall&);
+
+    RpcRecorder& recorder;
+    const char* rpc;
+    string key;
+    uint64_t bytes;
+    RpcRecorder::clock::time_point start;
+};
+
+#endif // RPCRECORDER_HPP
@@ -0,0 +1,69 @@
+#include "ServerLoad.hpp"
+
+using namespace std;
+
+ServerLoad::ServerLoad()
+{
+}
+
+void ServerLoad::reset(int num_servers)
+{
+    lock_guard<mutex> guard(lock);
+    rtts.assign(num_servers, 0);
+    rates.assign(num_servers, 0);
+    queued.assign(num_servers, 0);
+}
+
+void ServerLoad::setRTT(int server, double seconds)
+{
+    lock_guard<mutex> guard(lock);
+    rtts[server] = seconds;
+}
+
+void ServerLoad::record(int server, size_t bytes, double seconds)
+{
+    if (seconds <= 0) {
+        return;
+    }
+
+    lock_guard<mutex> guard(lock);
+    // the round trip is latency, not bandwidth
+    double transfer = seconds - rtts[server];
+    if (transfer < seconds / 2) {
+        transfer = seconds / 2;
+    }
+    double sample = bytes / transfer;
+    if (rates[server] <= 0) {
+        rates[server] = sample;
+    } else {
+        rates[server] = EWMA_WEIGHT * sample + (1 - EWMA_WEIGHT) * rates[server];
+    }
+}
+
+void ServerLoad::setInflight(int server, int inflight)
+{
+    lock_guard<mutex> guard(lock);
+    queued[server] = inflight;
+}
+
+double ServerLoad::throughput(int server)
+{
+    lock_guard<mutex> guard(lock);
+    return rates[server];
+}
+
+int ServerLoad::inflight(int server)
+{
+    lock_guard<mutex> guard(lock);
+    return queued[server];
+}
+
+double ServerLoad::estimate(int server, size_t bytes)
+{
+    lock_guard<mutex> guard(lock);
+    // an unmeasured server looks free, so it gets probed
+    if (rates[server] <= 0) {
+        return rtts[server];
+    }
+    return rtts[server] + (queued[server] + 1) * (bytes / rates[server]);
+}
@@ -0,0 +1,36 @@
+#ifndef SERVERLOAD_HPP
+#define SERVERLOAD_HPP
+
+#include <vector>
+#include <mutex>
+
+using namespace std;
+
+// Client-side view of how fast and how busy each server is. Throughput is
+// an exponentially weighted moving average of observed transfers; in-flight
+// is the request count the server last reported in an RPC response.
+class ServerLoad {
+public:
+    ServerLoad();
+
+    void reset(int num_servers);
+    void setRTT(int server, double seconds);
+    void record(int server, size_t bytes, double seconds);
+    void setInflight(int server, int inflight);
+
+    double throughput(int server); // bytes per second, 0 if never measured
+    int inflight(int server);
+
+    // predicted seconds for `server` to take `bytes` more, given its queue
+    double estimate(int server, size_t bytes);
+
+    const double EWMA_WEIGHT = 0.3; // weight of the newest sample
+
+protected:
+    mutex lock;
+    vector<double> rtts;
+    vector<double> rates;
+    vector<int> queued;
+};
+
+#endif // SERVERLOAD_HPP
@@ -1,14 +1,52 @@
 #include <sysexits.h>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
 
 #include "rpc/server.h"
+#include "rpc/this_handler.h"
+#include "rpc/this_session.h"
+#include "picosha2/picosha2.h"
 
 #include "logger.hpp"
 #include "SurfStoreTypes.hpp"
 #include "SurfStoreServer.hpp"
+#include "Replicator.hpp"
+#include "MetadataStore.hpp"
+#include "BlockCollector.hpp"
+#include "Delta.hpp"
+#include "Trace.hpp"
+#include "RpcRecorder.hpp"
+
+// the calling connection as a span's peer, so a trace can tell clients apart
+static void trace_caller(TraceSpan& span)
+{
+    if (span.active()) {
+        span.setPeer(trace_peer((uint64_t) rpc::this_session().id()));
+    }
+}
+
+// serialized size of an rpc argument or reply, for a span's byte count
+template <typename T>
+static uint64_t packed_size(const T& value)
+{
+    clmdep_msgpack::sbuffer buf;
+    clmdep_msgpack::pack(buf, value);
+    return buf.size();
+}
+
+// counts a request as in flight for as long as its handler runs
+struct InflightGuard {
+    InflightGuard(atomic<int>& t_counter) : counter(t_counter) { counter++; }
+    ~InflightGuard() { counter--; }
+    atomic<int>& counter;
+};
 
 SurfStoreServer::SurfStoreServer(INIReader& t_config, int t_servernum)
-    : config(t_config), servernum(t_servernum)
+    : config(t_config), servernum(t_servernum), inflight(0), watchers(0), changeSeq(0),
+      filterCapacity(0), blockFilter(make_shared<BloomFilter>()), filterStale(false)
 {
     auto log = logger();
 
@@ -29,6 +67,113 @@ SurfStoreServer::SurfStoreServer(INIReader& t_config, int t_servernum)
 		log->error("The port provided is invalid: {}", servconf);
 		exit(EX_CONFIG);
 	}
+
+	rpc_threads = (int) config.GetInteger("ssd", "rpc_threads", 1);
+	if (rpc_threads <= 0) {
+		log->error("Invalid number of rpc threads: {}", rpc_threads);
+		exit(EX_CONFIG);
+	}
+
+	lease_ms = (int) config.GetInteger("ssd", "lease_ms", 30000);
+	watch_ms = (int) config.GetInteger("ssd", "watch_ms", 5000);
+	watch_log = (size_t) config.GetInteger("ssd", "watch_log", 10000);
+	if (lease_ms < 0 || watch_ms < 0 || watch_log == 0) {
+		log->error("Invalid lease settings: lease {}ms watch {}ms log {}", lease_ms, watch_ms, watch_log);
+		exit(EX_CONFIG);
+	}
+	// every parked watch holds a handler thread, so only a few may wait at
+	// once and the rest answer immediately; with one thread none may wait
+	// a fresh epoch per run tells clients the change sequence started over
+	random_device seed;
+	epoch = ((uint64_t) seed() << 32 | seed()) | 1;
+
+	watch_waiters = (int) config.GetInteger("ssd", "watch_waiters", rpc_threads / 4);
+	if (watch_waiters < 0 || watch_waiters * 2 > rpc_threads - 1) {
+		log->error("Invalid watch waiters: {} (at most {} with {} rpc threads)",
+		           watch_waiters, (rpc_threads - 1) / 2, rpc_threads);
+		exit(EX_CONFIG);
+	}
+
+	filter_entries = (size_t) config.GetInteger("ssd", "filter_entries", 1000000);
+	filter_fp = config.GetReal("ssd", "filter_fp", 0.01);
+	if (filter_fp <= 0 || filter_fp >= 1) {
+		log->error("Invalid block filter false positive rate: {}", filter_fp);
+		exit(EX_CONFIG);
+	}
+}
+
+// a filter sized for some headroom over `hashes`; call with filterLock held
+shared_ptr<BloomFilter> SurfStoreServer::buildFilter(const vector<string>& hashes)
+{
+    filterCapacity = max(filter_entries, 2 * hashes.size());
+    size_t bits = BloomFilter::bitsFor(filterCapacity, filter_fp);
+    shared_ptr<BloomFilter> filter =
+        make_shared<BloomFilter>(bits, BloomFilter::hashesFor(bits, filterCapacity));
+    for (auto& hash: hashes) {
+        filter->add(hash);
+    }
+    return filter;
+}
+
+void SurfStoreServer::filterAdd(const string& hash)
+{
+    if (filter_entries == 0 || filterStale) {
+        return;
+    }
+    // nobody has asked for the filter in a while: rebuild it when they do
+    // rather than remember every hash until then
+    if (filterPending.size() >= filter_entries) {
+        filterPending.clear();
+        filterStale = true;
+        return;
+    }
+    filterPending.push_back(hash);
+}
+
+// the filter can't forget blocks, so it is rebuilt from a snapshot of
+// blockStore's keys once it has outgrown its size or blocks were dropped;
+// otherwise the blocks stored since are added to a copy. Either way the
+// work happens outside storeLock.
+shared_ptr<const BloomFilter> SurfStoreServer::currentFilter()
+{
+    lock_guard<mutex> build(filterLock);
+    shared_ptr<const BloomFilter> filter;
+    vector<string> added;
+    vector<string> keys;
+    bool rebuild;
+    {
+        lock_guard<mutex> lock(storeLock);
+        filter = blockFilter;
+        if (filter_entries == 0) {
+            return filter;
+        }
+        added.swap(filterPending);
+        size_t entries = filter->entries() + added.size();
+        rebuild = filterStale || entries > filterCapacity || blockStore.size() < entries * 3 / 4;
+        if (rebuild) {
+            keys.reserve(blockStore.size());
+            for (auto& block: blockStore) {
+                keys.push_back(block.first);
+            }
+            filterStale = false;
+        }
+    }
+    if (!rebuild && added.empty()) {
+        return filter;
+    }
+
+    shared_ptr<BloomFilter> next;
+    if (rebuild) {
+        next = buildFilter(keys);
+    } else {
+        next = make_shared<BloomFilter>(*filter);
+        for (auto& hash: added) {
+            next->add(hash);
+        }
+    }
+    lock_guard<mutex> lock(storeLock);
+    blockFilter = next;
+    return next;
 }
 
 void SurfStoreServer::launch()
@@ -38,9 +183,35 @@ void SurfStoreServer::launch()
     log->info("Launching SurfStore server");
     log->info("My ID is: {}", servernum);
     log->info("Port: {}", port);
+    log->info("RPC threads: {}", rpc_threads);
+
+    // spans of every request, one trace file per server
+    string trace_file = config.Get("ssd", "trace_file", "");
+    if (!trace_file.empty()) {
+        trace_start(trace_file + "." + to_string(servernum), "ssd " + to_string(servernum));
+    }
+
+    // the request stream, for replaying against test servers
+    string record_file = config.Get("ssd", "record_file", "");
+    RpcRecorder recorder(record_file.empty() ? "" : record_file + "." + to_string(servernum));
 
     rpc::server srv(port);
 
+    Replicator replicator(config, servernum, blockStore, storeLock);
+
+    // bring fileMap back from the last snapshot and write-ahead log
+    MetadataStore metadata(config, servernum);
+    metadata.recover(fileMap);
+    log->info("Serving {} files", fileMap.size());
+
+    BlockCollector collector(config, servernum, blockStore, storeLock);
+    {
+        lock_guard<mutex> lock(storeLock);
+        collector.rebuild(fileMap);
+        filterStale = filter_entries > 0;
+    }
+    currentFilter();
+
     srv.bind("ping", []() {
             auto log = logger();
             log->info("ping()");
@@ -48,76 +219,405 @@ void SurfStoreServer::launch()
             });
 
     //TODO: get a block for a specific hash
-    srv.bind("get_block", [&](string hash) {
+    srv.bind("get_block", [&](const string& hash) {
 
-            auto log = logger();
-            log->info("get_block()");
+            InflightGuard guard(inflight);
+            TRACE_SPAN_AT(span, "get_block");
+            trace_caller(span);
+            RecordedCall call(recorder, "get_block");
+            call.setKey(hash);
+            LOG_VERBOSE("get_block()");
 
-            // if key does not exist in map
-            if (blockStore.count(hash) <= 0)
+            lock_guard<mutex> lock(storeLock);
+            auto it = blockStore.find(hash);
+            // if key does not exist in map; an error rather than an empty
+            // reply, since an empty file's block is legitimately empty
+            if (it == blockStore.end())
             {
-            string empty = "";
-            log->error("Block doesn't exist");
-            return empty;
+            logger()->error("Block doesn't exist");
+            rpc::this_handler().respond_error("block not found");
+            return BlockBuffer();
             }
-            return blockStore.at(hash);
+            span.setBytes(it->second.size());
+            call.setBytes(it->second.size());
+            // shares the stored buffer; msgpack serializes straight from it
+            return it->second;
             });
 
     // get all blockStore
     srv.bind("get_all_blocks", [&]() {
           auto log = logger();
           log->info("get_all_blocks()");
+          lock_guard<mutex> lock(storeLock);
           return blockStore;
           });
 
+    // list the hashes of every block held here, used to compare inventories
+    srv.bind("get_block_list", [&]() {
+          auto log = logger();
+          log->info("get_block_list()");
+          RecordedCall call(recorder, "get_block_list");
+          vector<string> hashes;
+          lock_guard<mutex> lock(storeLock);
+          hashes.reserve(blockStore.size());
+          for (auto& block: blockStore) {
+              hashes.push_back(block.first);
+          }
+          return hashes;
+          });
+
+    // the servers this one found live on its last repair pass; peers only
+    // rebalance while their views agree
+    srv.bind("get_live_view", [&]() {
+          return replicator.view();
+          });
+
     //TODO: store a block
-    srv.bind("store_block", [&](string hash, string data) {
+    // returns the number of requests in flight here, so clients can steer
+    // new blocks away from a busy server
+    // takes the decoded data by reference so it can be moved into the
+    // store rather than copied
+    srv.bind("store_block", [&](const string& hash, string& data) {
 
-            auto log = logger();
-            log->info("store_block()");
+            InflightGuard guard(inflight);
+            TRACE_SPAN_AT(span, "store_block");
+            trace_caller(span);
+            span.setBytes(data.size());
+            RecordedCall call(recorder, "store_block");
+            call.setKey(hash);
+            call.setBytes(data.size());
+            LOG_VERBOSE("store_block()");
 
-            blockStore[hash] = data;
+            BlockBuffer block(std::move(data));
+            {
+                lock_guard<mutex> lock(storeLock);
+                if (blockStore.count(hash) == 0) {
+                    filterAdd(hash);
+                }
+                blockStore[hash] = std::move(block);
+                collector.stored(hash);
+            }
 
-            return;
+            return inflight.load();
+            });
+
+    // rolling-checksum signatures of the listed blocks held here, for
+    // clients building deltas against a file's previous version
+    srv.bind("get_signatures", [&](vector<string> hashes, int chunk) {
+            InflightGuard guard(inflight);
+            TRACE_SPAN_AT(span, "get_signatures");
+            trace_caller(span);
+            RecordedCall call(recorder, "get_signatures");
+            call.setBytes(hashes.size());
+            LOG_VERBOSE("get_signatures()");
+
+            vector<BlockSignature> sigs;
+            if (chunk <= 0) {
+                return sigs;
+            }
+            for (auto& hash: hashes) {
+                BlockBuffer block;
+                {
+                    lock_guard<mutex> lock(storeLock);
+                    auto it = blockStore.find(hash);
+                    if (it == blockStore.end()) {
+                        continue;
+                    }
+                    block = it->second;
+                }
+                vector<BlockSignature> blockSigs = compute_signatures(hash,
+                        string(block.data(), block.size()), chunk);
+                sigs.insert(sigs.end(), blockSigs.begin(), blockSigs.end());
+            }
+            if (span.active()) {
+                span.setBytes(packed_size(sigs));
+            }
+            return sigs;
+            });
+
+    // store a block sent as a delta against blocks held here; returns the
+    // in-flight count like store_block, or -1 if a source block is missing
+    // or the result does not match its hash, and the client sends it whole
+    srv.bind("store_delta", [&](const string& hash, vector<DeltaOp> ops) {
+            InflightGuard guard(inflight);
+            TRACE_SPAN_AT(span, "store_delta");
+            trace_caller(span);
+            RecordedCall call(recorder, "store_delta");
+            call.setKey(hash);
+            LOG_VERBOSE("store_delta()");
+
+            unordered_map<string, BlockBuffer> sources;
+            {
+                lock_guard<mutex> lock(storeLock);
+                for (auto& op: ops) {
+                    const string& source = get<0>(op);
+                    auto it = blockStore.find(source);
+                    if (!source.empty() && it != blockStore.end()) {
+                        sources[source] = it->second;
+                    }
+                }
+            }
+
+            string data;
+            if (!apply_delta(ops, sources, data) ||
+                picosha2::hash256_hex_string(data) != hash) {
+                logger()->error("Delta for block {} does not apply", hash);
+                return -1;
+            }
+            if (span.active()) {
+                span.setBytes(packed_size(ops));
+            }
+            call.setBytes(delta_size(ops));
+
+            BlockBuffer block(std::move(data));
+            {
+                lock_guard<mutex> lock(storeLock);
+                if (blockStore.count(hash) == 0) {
+                    filterAdd(hash);
+                }
+                blockStore[hash] = std::move(block);
+                collector.stored(hash);
+            }
+            return inflight.load();
             });
 
     //TODO: download a FileInfo Map from the server
     srv.bind("get_fileinfo_map", [&]() {
             auto log = logger();
             log->info("get_fileinfo_map()");
+            RecordedCall call(recorder, "get_fileinfo_map");
 
+            lock_guard<mutex> lock(mapLock);
             return fileMap;
             });
 
-    //TODO: update the FileInfo entry for a given file
-    srv.bind("update_file", [&](string filename, FileInfo finfo) {
-            log->info("updating file: {}", filename);
+    // apply one file update; the caller holds mapLock
+    // returns the metadata ticket to commit once mapLock is released, 0 if
+    // the update was refused
+    auto updateFile = [&](const string& filename, FileInfo finfo) -> uint64_t {
+            list<string> before;
             // check if file exists in server (in fileMap)
             if (fileMap.count(filename) <= 0)
             {
             // if it doesn't, create new entry with version 1
             get<0>(finfo) = 1;
-            fileMap[filename] = finfo;
             }
 
             else
             {
             FileInfo serverVer = fileMap.at(filename);
             // check if finfo version is server version + 1
-            if (get<0>(serverVer) == get<0>(finfo) - 1)
+            if (get<0>(serverVer) != get<0>(finfo) - 1)
             {
+            return 0;
+            }
+            before = get<1>(serverVer);
+            }
+
             fileMap[filename] = finfo;
+            uint64_t ticket = metadata.append(filename, finfo);
+
+            // tell watchers, so leased copies get dropped
+            changeLog.push_back(make_pair(++changeSeq, filename));
+            if (changeLog.size() > watch_log) {
+                changeLog.pop_front();
             }
+            changed.notify_all();
+
+            lock_guard<mutex> blockLock(storeLock);
+            collector.update(before, get<1>(finfo));
+            return ticket;
+    };
+
+    //TODO: update the FileInfo entry for a given file
+    srv.bind("update_file", [&](string filename, FileInfo finfo) {
+            TRACE_SPAN_AT(span, "update_file");
+            trace_caller(span);
+            if (span.active()) {
+                span.setBytes(packed_size(finfo));
+            }
+            RecordedCall call(recorder, "update_file");
+            call.setFilename(filename);
+            call.setBytes(get<1>(finfo).size());
+            LOG_VERBOSE("updating file: {}", filename);
+            uint64_t ticket;
+            {
+                lock_guard<mutex> lock(mapLock);
+                ticket = updateFile(filename, finfo);
+            }
+            // durable before we answer, but synced without the map lock
+            metadata.commit(ticket);
+    return;
+    });
+
+    // update many files in one round trip, e.g. a batch of packed small files
+    srv.bind("update_files", [&](FileInfoMap files) {
+            TRACE_SPAN_AT(span, "update_files");
+            trace_caller(span);
+            if (span.active()) {
+                span.setBytes(packed_size(files));
+            }
+            RecordedCall call(recorder, "update_files");
+            call.setBytes(files.size());
+            LOG_VERBOSE("updating {} files", files.size());
+            uint64_t ticket = 0;
+            {
+                lock_guard<mutex> lock(mapLock);
+                for (auto& file: files) {
+                    ticket = max(ticket, updateFile(file.first, file.second));
+                }
             }
+            metadata.commit(ticket);
     return;
     });
 
+    // the subset of `hashes` referenced by files in this server's shard,
+    // asked by peers before they reclaim blocks
+    srv.bind("referenced_blocks", [&](vector<string> hashes) {
+            TRACE_SPAN_AT(span, "referenced_blocks");
+            trace_caller(span);
+            RecordedCall call(recorder, "referenced_blocks");
+            call.setBytes(hashes.size());
+            vector<string> used;
+            lock_guard<mutex> lock(storeLock);
+            for (auto& hash: hashes) {
+                if (collector.referenced(hash)) {
+                    used.push_back(hash);
+                }
+            }
+            if (span.active()) {
+                span.setBytes(packed_size(used));
+            }
+            return used;
+            });
+
+    // the Bloom filter of blocks held here, as (hash count, bits). The bits
+    // are left empty when they would be more than max_bytes, i.e. more than
+    // the caller would send asking has_blocks directly.
+    srv.bind("get_block_filter", [&](uint64_t max_bytes) {
+            InflightGuard guard(inflight);
+            TRACE_SPAN_AT(span, "get_block_filter");
+            trace_caller(span);
+            RecordedCall call(recorder, "get_block_filter");
+            {
+                // don't bring a filter up to date for a caller that won't take it
+                lock_guard<mutex> lock(storeLock);
+                if (blockFilter->bits().size() > max_bytes) {
+                    return make_tuple(blockFilter->hashes(), string());
+                }
+            }
+            // the filter is immutable once published, so its bits are copied
+            // without any lock held
+            shared_ptr<const BloomFilter> filter = currentFilter();
+            if (filter->bits().size() > max_bytes) {
+                return make_tuple(filter->hashes(), string());
+            }
+            span.setBytes(filter->bits().size());
+            call.setBytes(filter->bits().size());
+            return make_tuple(filter->hashes(), filter->bits());
+            });
+
+    // the subset of `hashes` held here. Blocks found get a fresh grace
+    // period, so they survive until the caller's update_file references them.
+    srv.bind("has_blocks", [&](vector<string> hashes) {
+            InflightGuard guard(inflight);
+            TRACE_SPAN_AT(span, "has_blocks");
+            trace_caller(span);
+            RecordedCall call(recorder, "has_blocks");
+            call.setBytes(hashes.size());
+            vector<string> present;
+            lock_guard<mutex> lock(storeLock);
+            for (auto& hash: hashes) {
+                if (blockStore.count(hash) > 0) {
+                    present.push_back(hash);
+                    collector.stored(hash);
+                }
+            }
+            if (span.active()) {
+                span.setBytes(packed_size(present));
+            }
+            return present;
+            });
+
+    // the whole map under a lease: (epoch, change sequence, lease ms, map)
+    srv.bind("lease_fileinfo_map", [&]() {
+            RecordedCall call(recorder, "lease_fileinfo_map");
+            lock_guard<mutex> lock(mapLock);
+            return make_tuple(epoch, changeSeq, lease_ms, fileMap);
+            });
+
+    // one file under a lease: (epoch, change sequence, lease ms, FileInfo)
+    srv.bind("lease_file", [&](string filename) {
+            RecordedCall call(recorder, "lease_file");
+            call.setFilename(filename);
+            lock_guard<mutex> lock(mapLock);
+            auto it = fileMap.find(filename);
+            return make_tuple(epoch, changeSeq, lease_ms, it == fileMap.end() ? FileInfo() : it->second);
+            });
+
+    // long poll: wait up to timeout_ms (capped at watch_ms) for updates after
+    // `since` in `seen_epoch`, then return (epoch, sequence, reset, changed
+    // names). reset means the change log no longer reaches back to `since`,
+    // or the sequence is from an earlier run of this server, and every lease
+    // is void. Past watch_waiters parked calls it answers at once, so long
+    // polls never tie up the handlers the block and metadata rpcs need.
+    srv.bind("watch", [&](uint64_t seen_epoch, uint64_t since, int timeout_ms) {
+            InflightGuard parked(watchers);
+            unique_lock<mutex> lock(mapLock);
+            bool restarted = seen_epoch != epoch;
+            int wait = watchers > watch_waiters || restarted ? 0 : min(max(timeout_ms, 0), watch_ms);
+            changed.wait_for(lock, chrono::milliseconds(wait),
+                             [&]() { return changeSeq > since; });
+
+            bool reset = restarted || since > changeSeq ||
+                (!changeLog.empty() && changeLog.front().first > since + 1);
+            vector<string> names;
+            if (!reset) {
+                for (auto it = changeLog.rbegin(); it != changeLog.rend() && it->first > since; ++it) {
+                    names.push_back(it->second);
+                }
+            }
+            return make_tuple(epoch, changeSeq, reset, names);
+            });
+
+    // block store and garbage collection counters
+    srv.bind("get_stats", [&]() {
+            map<string, double> stats;
+            {
+                lock_guard<mutex> lock(mapLock);
+                stats["files"] = fileMap.size();
+            }
+            {
+                lock_guard<mutex> lock(storeLock);
+                stats["blocks"] = blockStore.size();
+            }
+            stats["inflight"] = inflight.load();
+            collector.stats(stats);
+            return stats;
+            });
+
     // this rpc returns the FileInfo of the file filename
     srv.bind("file_version", [&](string filename) {
-        return fileMap[filename];
+        RecordedCall call(recorder, "file_version");
+        call.setFilename(filename);
+        lock_guard<mutex> lock(mapLock);
+        // look up without inserting, so probes don't end up in snapshots
+        auto it = fileMap.find(filename);
+        if (it == fileMap.end()) {
+            return FileInfo();
+        }
+        return it->second;
     });
 
     // You may add additional RPC bindings as necessary
 
+    replicator.start();
+    metadata.start(fileMap, mapLock);
+    collector.start();
+    // extra handler threads, then this one serves too until the process is
+    // killed
+    if (rpc_threads > 1) {
+        srv.async_run(rpc_threads - 1);
+    }
     srv.run();
 }
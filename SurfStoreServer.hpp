@@ -2,9 +2,18 @@
 #ifndef SURFSTORESERVER_HPP
 #define SURFSTORESERVER_HPP
 
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <memory>
+
 #include "inih/INIReader.h"
 #include "logger.hpp"
 #include "SurfStoreTypes.hpp"
+#include "BlockBuffer.hpp"
+#include "BloomFilter.hpp"
 using namespace std;
 
 class SurfStoreServer {
@@ -13,14 +22,48 @@ public:
 
     void launch();
 
+    // notes a newly stored block for the filter; call with storeLock held
+    void filterAdd(const string& hash);
+    // the filter with every block noted so far; takes storeLock itself
+    shared_ptr<const BloomFilter> currentFilter();
+
 	const uint64_t RPC_TIMEOUT = 10000; // milliseconds
 
 protected:
     INIReader& config;
 	const int servernum;
 	int port;
-    unordered_map<string, string> blockStore; // hash table to store blocks
+	int rpc_threads; // handler threads, more than one lets requests queue in parallel
+	atomic<int> inflight; // requests currently being handled, reported to clients
+    unordered_map<string, BlockBuffer> blockStore; // hash table to store blocks
+    mutex storeLock; // guards blockStore, shared with the replicator
     FileInfoMap fileMap; // map to store files
+    mutex mapLock; // guards fileMap
+
+    // metadata leases: clients cache FileInfo for lease_ms and long-poll
+    // watch for the names changed since the sequence number they hold
+    int lease_ms;
+    int watch_ms; // longest a watch call waits
+    int watch_waiters; // watch calls allowed to wait at once
+    atomic<int> watchers; // watch calls in progress
+    size_t watch_log; // changes remembered for watchers
+    uint64_t epoch; // random per run; sequences only compare within one
+    uint64_t changeSeq; // guarded by mapLock
+    deque<pair<uint64_t, string>> changeLog; // guarded by mapLock
+    condition_variable changed;
+
+    // Bloom filter of the blocks held here, so clients can skip sending
+    // blocks the cluster already has. A published filter is never changed:
+    // updates build a new one outside storeLock and swap it in, so the bits
+    // go out to clients without holding up the block rpcs.
+    shared_ptr<BloomFilter> buildFilter(const vector<string>& hashes);
+    size_t filter_entries; // blocks the filter is sized for at least
+    double filter_fp; // target false positive rate
+    mutex filterLock; // serializes filter updates; taken before storeLock
+    size_t filterCapacity; // blocks the current filter was sized for, guarded by filterLock
+    shared_ptr<const BloomFilter> blockFilter; // guarded by storeLock
+    vector<string> filterPending; // stored since blockFilter, guarded by storeLock
+    bool filterStale; // blockFilter needs a rebuild, guarded by storeLock
 };
 
 #endif // SURFSTORESERVER_HPP
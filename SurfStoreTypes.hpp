@@ -5,8 +5,44 @@
 #include <map>
 #include <list>
 #include <string>
+#include <stdlib.h>
 
 typedef tuple<int, list<string>> FileInfo;
 typedef map<string, FileInfo> FileInfoMap;
 
+// rolling-checksum signature of one chunk of a stored block:
+// (block hash, offset, length, weak checksum, strong checksum)
+typedef tuple<string, int, int, unsigned int, string> BlockSignature;
+// one step of rebuilding a block from a delta: copy (hash, offset, length)
+// out of an existing block, or, when the hash is empty, append the literal
+typedef tuple<string, int, int, string> DeltaOp;
+
+// An entry of a FileInfo block list is either a block hash, or an extent
+// "<hash>@<offset>+<length>" naming part of a segment block that several
+// small files were packed into.
+inline string make_extent(const string& hash, size_t offset, size_t length)
+{
+    return hash + "@" + to_string(offset) + "+" + to_string(length);
+}
+
+inline bool parse_extent(const string& ref, string& hash, size_t& offset, size_t& length)
+{
+    size_t at = ref.find('@');
+    size_t plus = ref.find('+', at);
+    if (at == string::npos || plus == string::npos) {
+        return false;
+    }
+    hash = ref.substr(0, at);
+    offset = strtoull(ref.c_str() + at + 1, nullptr, 10);
+    length = strtoull(ref.c_str() + plus + 1, nullptr, 10);
+    return true;
+}
+
+// the block a block list entry lives in
+inline string block_of(const string& ref)
+{
+    size_t at = ref.find('@');
+    return at == string::npos ? ref : ref.substr(0, at);
+}
+
 #endif // SURFSTORETYPES_HPP
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "logger.hpp"
+#include "Trace.hpp"
+
+using namespace std;
+
+atomic<bool> trace_enabled(false);
+
+static const size_t RING_SIZE = 8192; // records per thread, a power of two
+static const int FLUSH_MS = 50; // drain interval
+
+// written only by its thread, read only by the drainer
+struct TraceRing {
+    atomic<uint64_t> head; // next slot the thread fills
+    atomic<uint64_t> tail; // next slot the drainer reads
+    uint32_t thread;
+    TraceRecord records[RING_SIZE];
+};
+
+static mutex traceLock; // guards everything below
+static vector<TraceRing*> rings; // never freed, a thread may still be writing
+static vector<string> names;
+static size_t namesWritten = 0;
+static FILE* traceFile = nullptr;
+static thread drainer;
+static bool draining = false;
+static condition_variable wakeup;
+static atomic<uint64_t> dropped(0);
+
+static thread_local TraceRing* myRing = nullptr;
+
+uint16_t trace_name(const char* name)
+{
+    lock_guard<mutex> lock(traceLock);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (names[i] == name) {
+            return (uint16_t) i;
+        }
+    }
+    names.push_back(name);
+    return (uint16_t) (names.size() - 1);
+}
+
+// connections this thread has seen, so the shared table is consulted once
+// per connection and thread rather than on every span
+struct PeerSlot {
+    uint64_t connection;
+    int peer;
+};
+static const size_t PEER_SLOTS = 64; // a power of two
+static thread_local PeerSlot myPeers[PEER_SLOTS];
+
+int trace_peer(uint64_t connection)
+{
+    PeerSlot& slot = myPeers[(connection * 0x9E3779B97F4A7C15ULL >> 32) & (PEER_SLOTS - 1)];
+    if (slot.peer > 0 && slot.connection == connection) {
+        return slot.peer - 1;
+    }
+
+    static mutex peerLock;
+    static unordered_map<uint64_t, int> peers;
+    int peer;
+    {
+        lock_guard<mutex> lock(peerLock);
+        auto it = peers.find(connection);
+        if (it == peers.end()) {
+            it = peers.emplace(connection, (int) (peers.size() % 32768)).first;
+        }
+        peer = it->second;
+    }
+    slot.connection = connection;
+    slot.peer = peer + 1;
+    return peer;
+}
+
+void trace_record(uint16_t name, uint64_t start_ns, uint64_t dur_ns, uint64_t bytes, int peer)
+{
+    if (myRing == nullptr) {
+        myRing = new TraceRing();
+        myRing->head = 0;
+        myRing->tail = 0;
+        lock_guard<mutex> lock(traceLock);
+        myRing->thread = (uint32_t) rings.size();
+        rings.push_back(myRing);
+    }
+
+    uint64_t head = myRing->head.load(memory_order_relaxed);
+    if (head - myRing->tail.load(memory_order_acquire) >= RING_SIZE) {
+        dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    TraceRecord& record = myRing->records[head & (RING_SIZE - 1)];
+    record.start_ns = start_ns;
+    record.dur_ns = dur_ns;
+    record.bytes = bytes;
+    record.thread = myRing->thread;
+    record.name = name;
+    record.peer = (int16_t) peer;
+    myRing->head.store(head + 1, memory_order_release);
+}
+
+// copies every ring's records out to the file; call with traceLock held
+static void drain()
+{
+    vector<TraceRecord> batch;
+    for (TraceRing* ring: rings) {
+        uint64_t tail = ring->tail.load(memory_order_relaxed);
+        uint64_t head = ring->head.load(memory_order_acquire);
+        for (; tail < head; tail++) {
+            batch.push_back(ring->records[tail & (RING_SIZE - 1)]);
+        }
+        ring->tail.store(tail, memory_order_release);
+    }
+
+    // a drained span's name was interned before it was recorded
+    for (; namesWritten < names.size(); namesWritten++) {
+        uint16_t id = (uint16_t) namesWritten;
+        uint16_t len = (uint16_t) names[namesWritten].size();
+        fputc(TRACE_NAME, traceFile);
+        fwrite(&id, sizeof(id), 1, traceFile);
+        fwrite(&len, sizeof(len), 1, traceFile);
+        fwrite(names[namesWritten].data(), 1, len, traceFile);
+    }
+    for (auto& record: batch) {
+        fputc(TRACE_SPAN, traceFile);
+        fwrite(&record, sizeof(record), 1, traceFile);
+    }
+    fflush(traceFile);
+}
+
+static void drainLoop()
+{
+    unique_lock<mutex> lock(traceLock);
+    while (draining) {
+        wakeup.wait_for(lock, chrono::milliseconds(FLUSH_MS));
+        drain();
+    }
+}
+
+void trace_start(const string& path, const string& label)
+{
+    auto log = logger();
+
+    if (path.empty()) {
+        return;
+    }
+    lock_guard<mutex> lock(traceLock);
+    if (traceFile != nullptr) {
+        return;
+    }
+    traceFile = fopen(path.c_str(), "wb");
+    if (traceFile == nullptr) {
+        log->error("Unable to open trace file {}", path);
+        return;
+    }
+
+    TraceHeader header;
+    header.pid = (uint32_t) getpid();
+    header.label_len = (uint32_t) label.size();
+    header.epoch_ns = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count() - (int64_t) trace_now();
+    fwrite(TRACE_MAGIC, 1, 8, traceFile);
+    fwrite(&header, sizeof(header), 1, traceFile);
+    fwrite(label.data(), 1, label.size(), traceFile);
+    namesWritten = 0;
+
+    log->info("Tracing to {}", path);
+    draining = true;
+    drainer = thread(drainLoop);
+    trace_enabled = true;
+}
+
+void trace_stop()
+{
+    auto log = logger();
+
+    trace_enabled = false;
+    {
+        lock_guard<mutex> lock(traceLock);
+        if (traceFile == nullptr) {
+            return;
+        }
+        draining = false;
+    }
+    wakeup.notify_all();
+    drainer.join();
+
+    lock_guard<mutex> lock(traceLock);
+    drain();
+    fclose(traceFile);
+    traceFile = nullptr;
+    if (dropped > 0) {
+        log->info("Trace dropped {} spans from full buffers", dropped.load());
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+using namespace std;
+
+// Low-overhead span tracing. Each thread records finished spans into its own
+// single-producer ring; a background thread drains the rings into a binary
+// trace file that trace2json converts for chrome://tracing. Recording is a
+// clock read and a ring store, and a single relaxed load while tracing is off.
+//
+// File layout: TRACE_MAGIC, TraceHeader, then tagged records: TRACE_NAME
+// (u16 id, u16 length, name bytes) introduces a span name before its first
+// use; TRACE_SPAN is followed by a TraceRecord.
+
+#define TRACE_MAGIC "SSTRACE1"
+const char TRACE_NAME = 'N';
+const char TRACE_SPAN = 'S';
+
+struct TraceHeader {
+    uint32_t pid;
+    uint32_t label_len; // label bytes follow the header
+    int64_t epoch_ns; // add to a span's start for wall clock time
+};
+
+struct TraceRecord {
+    uint64_t start_ns; // steady clock
+    uint64_t dur_ns;
+    uint64_t bytes;
+    uint32_t thread; // small per-process thread number
+    uint16_t name;
+    int16_t peer; // server index on clients, connection number on servers, -1 when there is none
+};
+
+// opens `path` and starts draining; an empty path leaves tracing off
+void trace_start(const string& path, const string& label);
+// drains what is left and closes the file
+void trace_stop();
+// id for a span name; call once per site, e.g. through TRACE_SPAN_AT
+uint16_t trace_name(const char* name);
+void trace_record(uint16_t name, uint64_t start_ns, uint64_t dur_ns, uint64_t bytes, int peer);
+// small per-process number for an opaque connection id, to use as a peer
+int trace_peer(uint64_t connection);
+
+extern atomic<bool> trace_enabled;
+
+inline uint64_t trace_now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// times the enclosing scope
+class TraceSpan {
+public:
+    explicit TraceSpan(uint16_t t_name, int t_peer = -1)
+        : name(t_name), peer(t_peer), bytes(0),
+          start(trace_enabled.load(memory_order_relaxed) ? trace_now() : 0) {}
+    ~TraceSpan()
+    {
+        if (start != 0) {
+            trace_record(name, start, trace_now() - start, bytes, peer);
+        }
+    }
+
+    void setBytes(uint64_t t_bytes) { bytes = t_bytes; }
+    void setPeer(int t_peer) { peer = t_peer; }
+    // false while tracing is off; guards work done only for the trace
+    bool active() const { return start != 0; }
+
+private:
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+
+    uint16_t name;
+    int peer;
+    uint64_t bytes;
+    uint64_t start;
+};
+
+// declares TraceSpan `var` named `name`, interning the name once per site
+#define TRACE_SPAN_AT(var, name) \
+    static const uint16_t var##_name = trace_name(name); \
+    TraceSpan var(var##_name)
+
+#endif // TRACE_HPP
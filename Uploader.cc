@@ -6,6 +6,12 @@
 #include <errno.h>
 #include <chrono>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <iterator>
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "rpc/server.h"
 #include "rpc/rpc_error.h"
@@ -13,11 +19,14 @@
 
 #include "logger.hpp"
 #include "Uploader.hpp"
+#include "Delta.hpp"
+#include "Placement.hpp"
+#include "Trace.hpp"
 
 using namespace std;
 
     Uploader::Uploader(INIReader& t_config, int localIndex)
-: config(t_config)
+: config(t_config), deltaSaved(0), dedupSkipped(0)
 {
     auto log = logger();
 
@@ -47,6 +56,49 @@ using namespace std;
     }
     log->info("Using a block placement policy of {}", policy);
 
+    // files smaller than this are packed together into shared segments
+    pack_threshold = (int) config.GetInteger("uploader", "pack_threshold", 0);
+    if (pack_threshold < 0 || pack_threshold > blocksize) {
+        log->error("Invalid pack threshold: {}", pack_threshold);
+        exit(EX_CONFIG);
+    }
+    if (pack_threshold > 0) {
+        log->info("Packing files smaller than {} bytes", pack_threshold);
+    }
+
+    // send modified blocks as deltas against the file's previous version
+    delta = config.GetBoolean("uploader", "delta", false);
+    delta_chunk = (int) config.GetInteger("uploader", "delta_chunk", 1024);
+    if (delta_chunk <= 0 || delta_chunk > blocksize) {
+        log->error("Invalid delta chunk size: {}", delta_chunk);
+        exit(EX_CONFIG);
+    }
+    if (delta) {
+        log->info("Sending deltas in chunks of {} bytes", delta_chunk);
+    }
+
+    // skip blocks some server already holds
+    dedup = config.GetBoolean("uploader", "dedup", false);
+    if (dedup) {
+        log->info("Skipping blocks the servers already hold");
+    }
+
+    // files committed per metadata round trip
+    update_batch = (int) config.GetInteger("uploader", "update_batch", 1);
+    if (update_batch <= 0) {
+        log->error("Invalid update batch size: {}", update_batch);
+        exit(EX_CONFIG);
+    }
+
+    // disk I/O engine for reading files in
+    io_depth = (int) config.GetInteger("uploader", "io_depth", 64);
+    if (io_depth <= 0) {
+        log->error("Invalid I/O queue depth: {}", io_depth);
+        exit(EX_CONFIG);
+    }
+    io = DiskIO::create(config.Get("uploader", "io_backend", "threads"), io_depth);
+    log->info("Reading files through {} I/O, depth {}", io->name(), io_depth);
+
     num_servers = (int) config.GetInteger("ssd", "num_servers", -1);
     if (num_servers <= 0) {
         log->error("num_servers {} is invalid", num_servers);
@@ -54,6 +106,13 @@ using namespace std;
     }
     log->info("Number of servers: {}", num_servers);
 
+    // servers per metadata shard, 0 keeps every file's metadata everywhere
+    metadata_replicas = (int) config.GetInteger("ssd", "metadata_replicas", 0);
+    if (metadata_replicas < 0) {
+        log->error("Invalid metadata replica count: {}", metadata_replicas);
+        exit(EX_CONFIG);
+    }
+
     for (int i = 0; i < num_servers; ++i) {
         string servconf = config.Get("ssd", "server"+std::to_string(i), "");
         if (servconf == "") {
@@ -84,6 +143,8 @@ void Uploader::upload()
 {
     auto log = logger();
 
+    trace_start(config.Get("uploader", "trace_file", ""), "uploader");
+
     vector<rpc::client*> clients;
 
     // Connect to all of the servers
@@ -102,7 +163,7 @@ void Uploader::upload()
     chrono::time_point<chrono::system_clock> start, end;
     chrono::duration<double> elapsed_seconds;
     double totalTime = 0;
-    double rtt [4];
+    vector<double> rtt(num_servers);
 
     // Issue a ping to each server 8 times
     for (int i = 0; i < num_servers; ++i)
@@ -127,6 +188,12 @@ void Uploader::upload()
         rtt[i] = (totalTime / 8);
     }
 
+    load.reset(num_servers);
+    for (int i = 0; i < num_servers; ++i)
+    {
+        load.setRTT(i, rtt[i]);
+    }
+
     for (int i = 0; i < num_servers; ++i)
     {
         log->info("average ping time for server {}: {}", i, rtt[i]);
@@ -135,6 +202,9 @@ void Uploader::upload()
     // create FileInfoMap for files in base directory
     FileInfoMap clientMap;
 
+    vector<string> smallFiles;
+    vector<string> filenames;
+
     // iterate through directory to get list of filenames
     DIR* dirp = opendir(base_dir.c_str());
     struct dirent * dp;
@@ -142,14 +212,45 @@ void Uploader::upload()
         // make sure file exists
         string str(dp->d_name);
         if(str.compare(".") != 0 && str.compare("..") != 0 && str.compare("index.txt")){
-            // create fileinfo for file, add to clientMap
-            clientMap[dp->d_name] = make_tuple(1, create_fileinfo(dp->d_name));
+            struct stat st;
+            string filepath = base_dir + "/" + str;
+            if (pack_threshold > 0 && stat(filepath.c_str(), &st) == 0 &&
+                    st.st_size < pack_threshold) {
+                smallFiles.push_back(str);
+                continue;
+            }
+            filenames.push_back(str);
         }
     }
     closedir(dirp);
 
+    // create fileinfo for each file, add to clientMap
+    create_fileinfos(filenames, clientMap);
+
+    packSmallFiles(smallFiles, clientMap);
+
+    if (delta)
+    {
+        findDeltaBases(clientMap, clients);
+    }
+
     // upload files and blocks using specified policy
-    policySelector(clientMap, rtt, clients);
+    placed.clear();
+    if (dedup)
+    {
+        findExistingBlocks(clientMap, clients);
+    }
+    policySelector(clientMap, rtt.data(), clients);
+    flushUpdates(clients);
+
+    if (delta)
+    {
+        log->info("delta encoding saved {} bytes", deltaSaved);
+    }
+    if (dedup)
+    {
+        log->info("deduplication saved {} bytes", dedupSkipped);
+    }
 
     // Delete the clients
     for (int i = 0; i < num_servers; ++i)
@@ -157,63 +258,78 @@ void Uploader::upload()
         log->info("Tearing down client {}", i);
         delete clients[i];
     }
+
+    trace_stop();
 }
 
 // returns list of hash values of blocks for given filename
 list<string> Uploader::create_fileinfo(string filename) {
-    ifstream file;
-    int size;
-    int filePos = 0;
-    char * data = new char[blocksize];
-    list<string> str_list;
-    string filepath = base_dir + "/" + filename;
-
-    file.open(filepath, ios::in|ios::binary);
-    if (file.is_open()) {
-        file.seekg(0, ios::end);
-        size = file.tellg();
-        file.seekg(0,file.beg);
-
-        //Entire file is less than 4096 bytes so it fits into one block
-        if (size < blocksize){
-            file.read(data, size);
-            string s = string(data, size);
-            string key = picosha2::hash256_hex_string(s);
-            str_list.push_back(key);
-            // store block in blockStore map
-            blockStore[key] = s;
-            return str_list;
-        }
-        //Entire file larger than 4096 bytes so it needs multiple blocks
-        else {
-            while(filePos != size){
-                // Less than 4096 bytes left to process
-                if(size - filePos < blocksize) {
-                    file.read(data, size - filePos);
-                    string s = string(data, size - filePos);
-                    string key = picosha2::hash256_hex_string(s);
-                    str_list.push_back(key);
-                    // store block in blockStore map
-                    blockStore[key] = s;
-                    return str_list;
-                }
-                // More than 4096 bytes left to process
-                else {
-                    file.read(data, blocksize);
-                    string s = string(data, blocksize);
-                    string key = picosha2::hash256_hex_string(s);
-                    str_list.push_back(key);
-                    // store block in blockStore map
-                    blockStore[key] = s;
-                    filePos += blocksize;
+    FileInfoMap fileMap;
+    create_fileinfos(vector<string>(1, filename), fileMap);
+    return get<1>(fileMap[filename]);
+}
+
+// chunks and hashes files into clientMap, reading the blocks of a window of
+// files at a time through the I/O engine so many reads are in flight at once
+void Uploader::create_fileinfos(const vector<string>& filenames, FileInfoMap& clientMap)
+{
+    auto log = logger();
+
+    for (size_t first = 0; first < filenames.size(); first += FILE_WINDOW) {
+        size_t count = min(FILE_WINDOW, filenames.size() - first);
+
+        vector<IORequest> opens;
+        for (size_t i = 0; i < count; i++) {
+            opens.push_back(IORequest::open(base_dir + "/" + filenames[first + i], O_RDONLY));
+        }
+        io->submit(opens);
+
+        // a file's blocks are cut at multiples of blocksize; an empty file
+        // is one empty block
+        vector<size_t> sizes(count, 0);
+        vector<size_t> firstBlock(count + 1, 0);
+        for (size_t i = 0; i < count; i++) {
+            struct stat st;
+            int fd = (int) opens[i].result;
+            if (fd >= 0 && fstat(fd, &st) == 0) {
+                sizes[i] = st.st_size;
+            }
+            size_t blocks = fd < 0 ? 0 : max((size_t) 1, (sizes[i] + blocksize - 1) / blocksize);
+            firstBlock[i + 1] = firstBlock[i] + blocks;
+        }
+
+        vector<string> data(firstBlock[count]);
+        vector<IORequest> reads;
+        reads.reserve(data.size());
+        for (size_t i = 0; i < count; i++) {
+            for (size_t b = firstBlock[i]; b < firstBlock[i + 1]; b++) {
+                size_t offset = (b - firstBlock[i]) * blocksize;
+                data[b].resize(min((size_t) blocksize, sizes[i] - offset));
+                reads.push_back(IORequest::read((int) opens[i].result, offset, &data[b][0], data[b].size()));
+            }
+        }
+        io->submit(reads);
+
+        for (size_t i = 0; i < count; i++) {
+            list<string> str_list;
+            for (size_t b = firstBlock[i]; b < firstBlock[i + 1]; b++) {
+                if (reads[b].result < 0) {
+                    log->error("Error reading {}: {}", filenames[first + i], strerror((int) -reads[b].result));
+                    break;
                 }
+                // a file that shrank while we read it ends early
+                data[b].resize(reads[b].result);
+                string key = picosha2::hash256_hex_string(data[b]);
+                str_list.push_back(key);
+                // store block in blockStore map
+                blockStore[key] = std::move(data[b]);
             }
+            if (opens[i].result >= 0) {
+                close((int) opens[i].result);
+            }
+            clientMap[filenames[first + i]] = make_tuple(1, str_list);
         }
     }
-    else {
-        return str_list;
-    }
-    return str_list;
 }
 
 void Uploader::policyRandom(FileInfoMap clientMap, vector<rpc::client*> clients)
@@ -225,19 +341,15 @@ void Uploader::policyRandom(FileInfoMap clientMap, vector<rpc::client*> clients)
     for (auto file: clientMap)
     {
         // loop through each block in each file
-        for (auto hash: get<1>(file.second))
+        for (auto hash: newBlocks(file.second))
         {
-            string data = blockStore[hash];
             int clientIndex = rand() % num_servers;
-            log->info("storing block in server {}", clientIndex);
-            clients[clientIndex]->call("store_block", hash, data);
+            LOG_VERBOSE("storing block in server {}", clientIndex);
+            storeBlock(clientIndex, hash, clients);
         }
 
         // update file for every server
-        for (int i = 0; i < num_servers; i++)
-        {
-            clients[i]->call("update_file", file.first, file.second);
-        }
+        commitFile(file.first, file.second, clients);
     }
 }
 
@@ -250,9 +362,8 @@ void Uploader::policyTwoRandom(FileInfoMap clientMap, vector<rpc::client*> clien
     for (auto file: clientMap)
     {
         // loop through each block in each file
-        for (auto hash: get<1>(file.second))
+        for (auto hash: newBlocks(file.second))
         {
-            string data = blockStore[hash];
             int clientIndex = rand() % num_servers;
             int clientIndex2 = rand() % num_servers;
             // make sure index is different
@@ -260,16 +371,13 @@ void Uploader::policyTwoRandom(FileInfoMap clientMap, vector<rpc::client*> clien
             {
                 clientIndex2 = rand() % num_servers;
             }
-            log->info("storing block in servers {} and {}", clientIndex, clientIndex2);
-            clients[clientIndex]->call("store_block", hash, data);
-            clients[clientIndex2]->call("store_block", hash, data);
+            LOG_VERBOSE("storing block in servers {} and {}", clientIndex, clientIndex2);
+            storeBlock(clientIndex, hash, clients);
+            storeBlock(clientIndex2, hash, clients);
         }
 
         // update file for every server
-        for (int i = 0; i < num_servers; i++)
-        {
-            clients[i]->call("update_file", file.first, file.second);
-        }
+        commitFile(file.first, file.second, clients);
     }
 }
 
@@ -280,19 +388,15 @@ void Uploader::policyLocal(FileInfoMap clientMap, vector<rpc::client*> clients)
     for (auto file: clientMap)
     {
         // loop through each block in each file
-        for (auto hash: get<1>(file.second))
+        for (auto hash: newBlocks(file.second))
         {
-            string data = blockStore[hash];
-            log->info("storing block in server {}", local);
+            LOG_VERBOSE("storing block in server {}", local);
             // store in local server
-            clients[local]->call("store_block", hash, data);
+            storeBlock(local, hash, clients);
         }
 
         // update file for every server
-        for (int i = 0; i < num_servers; i++)
-        {
-            clients[i]->call("update_file", file.first, file.second);
-        }
+        commitFile(file.first, file.second, clients);
     }
 }
 
@@ -309,15 +413,12 @@ void Uploader::policyLocalClosest(FileInfoMap clientMap, double rtt[], vector<rp
     }    
 
     for (auto file: clientMap) {
-        for (auto hash: get<1>(file.second)) {
-            string data = blockStore[hash];
-            log->info("storing block in servers {} and {}", local, index);
-            clients[local]->call("store_block", hash, data);
-            clients[index]->call("store_block", hash, data);
-        }
-        for (int i = 0; i < num_servers; i++) {
-            clients[i]->call("update_file", file.first, file.second);
+        for (auto hash: newBlocks(file.second)) {
+            LOG_VERBOSE("storing block in servers {} and {}", local, index);
+            storeBlock(local, hash, clients);
+            storeBlock(index, hash, clients);
         }
+        commitFile(file.first, file.second, clients);
     }  
 }
 
@@ -334,16 +435,484 @@ void Uploader::policyLocalFarthest(FileInfoMap clientMap, double rtt[], vector<r
     }
 
     for (auto file: clientMap) {
-        for (auto hash: get<1>(file.second)) {
-            string data = blockStore[hash];
-            log->info("storing block in servers {} and {}", local, index);
-            clients[local]->call("store_block", hash, data);
-            clients[index]->call("store_block", hash, data);
+        for (auto hash: newBlocks(file.second)) {
+            LOG_VERBOSE("storing block in servers {} and {}", local, index);
+            storeBlock(local, hash, clients);
+            storeBlock(index, hash, clients);
+        }
+        commitFile(file.first, file.second, clients);
+    }
+}
+
+// power of two choices: draw two servers per block and send it to the one
+// expected to finish first, judged by measured throughput and the queue depth
+// it reported last. Every transfer updates the estimates, so an overloaded
+// or slow server stops being picked within a few blocks.
+void Uploader::policyTwoChoice(FileInfoMap clientMap, vector<rpc::client*> clients)
+{
+    auto log = logger();
+    // reset random seed
+    srand(time(NULL));
+    for (auto file: clientMap)
+    {
+        for (auto hash: newBlocks(file.second))
+        {
+            int clientIndex = rand() % num_servers;
+            int clientIndex2 = clientIndex;
+            while (num_servers > 1 && clientIndex == clientIndex2)
+            {
+                clientIndex2 = rand() % num_servers;
+            }
+
+            size_t bytes = blockStore[hash].size();
+            if (load.estimate(clientIndex2, bytes) < load.estimate(clientIndex, bytes))
+            {
+                clientIndex = clientIndex2;
+            }
+            LOG_VERBOSE("storing block in server {}", clientIndex);
+            storeBlock(clientIndex, hash, clients);
+        }
+
+        commitFile(file.first, file.second, clients);
+    }
+}
+
+void Uploader::storeBlock(int server, const string& hash, vector<rpc::client*>& clients)
+{
+    const string& data = blockStore[hash];
+    size_t sent = data.size();
+    TRACE_SPAN_AT(span, "store_block");
+    span.setPeer(server);
+
+    chrono::time_point<chrono::steady_clock> start = chrono::steady_clock::now();
+    // a delta can only go to a server holding the blocks it refers to
+    int target = delta ? deltaServer(server, hash) : -1;
+    int inflight = target >= 0 ? storeDelta(target, hash, clients, sent) : -1;
+    if (inflight >= 0)
+    {
+        server = target;
+        span.setPeer(server);
+    }
+    else
+    {
+        inflight = clients[server]->call("store_block", hash, data).as<int>();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    span.setBytes(sent);
+
+    load.record(server, sent, elapsed.count());
+    // the count includes our own request
+    load.setInflight(server, inflight > 0 ? inflight - 1 : 0);
+}
+
+// asks the servers which of this upload's blocks they already hold. When a
+// server's Bloom filter is smaller than the hashes themselves, it rules most
+// blocks out locally first; has_blocks confirms the rest exactly. Blocks
+// found are marked placed, so no policy sends them again.
+void Uploader::findExistingBlocks(const FileInfoMap& clientMap, vector<rpc::client*>& clients)
+{
+    auto log = logger();
+
+    dedupSkipped = 0;
+
+    unordered_set<string> candidates;
+    for (auto& file: clientMap)
+    {
+        for (auto& ref: get<1>(file.second))
+        {
+            candidates.insert(block_of(ref));
         }
-        for (int i = 0; i < num_servers; i++) {
-            clients[i]->call("update_file", file.first, file.second);
+    }
+    size_t total = candidates.size();
+    size_t asked = 0;
+
+    for (int i = 0; i < num_servers && !candidates.empty(); i++)
+    {
+        try {
+            // the server leaves the bits out when asking about every
+            // candidate is cheaper; an empty filter then passes them all
+            uint64_t direct = (uint64_t) candidates.size() * HASH_BYTES;
+            tuple<int, string> reply =
+                clients[i]->call("get_block_filter", direct).as<tuple<int, string>>();
+            BloomFilter filter;
+            filter.assign(get<1>(reply), get<0>(reply));
+
+            vector<string> maybe;
+            for (auto& hash: candidates)
+            {
+                if (filter.mayContain(hash))
+                {
+                    maybe.push_back(hash);
+                }
+            }
+            asked += maybe.size();
+
+            for (size_t start = 0; start < maybe.size(); start += HAS_BLOCKS_BATCH)
+            {
+                vector<string> batch(maybe.begin() + start,
+                        maybe.begin() + min(maybe.size(), start + HAS_BLOCKS_BATCH));
+                vector<string> present = clients[i]->call("has_blocks", batch).as<vector<string>>();
+                for (auto& hash: present)
+                {
+                    if (candidates.erase(hash) > 0)
+                    {
+                        placed.insert(hash);
+                        dedupSkipped += blockStore[hash].size();
+                    }
+                }
+            }
+        } catch (std::exception &e) {
+            // the block is simply sent, as without deduplication
+            log->error("Unable to check existing blocks on server {}: {}", i, e.what());
         }
     }
+
+    log->info("{} of {} blocks already stored, {} checked exactly",
+              total - candidates.size(), total, asked);
+}
+
+// looks up each file's previous version; a new block of a modified file can
+// then be sent as a delta against the blocks around the same position in it.
+// Those blocks are looked up on every server, since only a server holding
+// them can apply the delta.
+void Uploader::findDeltaBases(FileInfoMap& clientMap, vector<rpc::client*>& clients)
+{
+    auto log = logger();
+
+    deltaBase.clear();
+    baseHolders.clear();
+    sigCache.assign(num_servers, unordered_map<string, vector<BlockSignature>>());
+    deltaSaved = 0;
+
+    for (auto& file: clientMap)
+    {
+        // any replica of the shard will do; if none answers, the file is
+        // uploaded whole
+        FileInfo previous;
+        bool found = false;
+        for (int owner: metadata_owners(file.first, num_servers, metadata_replicas))
+        {
+            try {
+                previous = clients[owner]->call("file_version", file.first).as<FileInfo>();
+                found = true;
+                break;
+            } catch (std::exception &e) {
+                log->error("Unable to get the version of {} from server {}: {}",
+                           file.first, owner, e.what());
+            }
+        }
+        if (!found || get<0>(previous) <= 0 || get<1>(previous) == get<1>(file.second))
+        {
+            continue;
+        }
+        // commit as the next version so the server accepts the change
+        get<0>(file.second) = get<0>(previous) + 1;
+
+        vector<string> before;
+        unordered_set<string> seen;
+        for (auto& ref: get<1>(previous))
+        {
+            before.push_back(block_of(ref));
+            seen.insert(before.back());
+        }
+        if (before.empty())
+        {
+            continue;
+        }
+        size_t position = 0;
+        for (auto& ref: get<1>(file.second))
+        {
+            string hash = block_of(ref);
+            size_t at = min(position++, before.size() - 1);
+            if (seen.count(hash) > 0 || deltaBase.count(hash) > 0)
+            {
+                continue;
+            }
+            // the block at the same position first, then its neighbours,
+            // which hold the data an insert or delete shifted
+            vector<string>& bases = deltaBase[hash];
+            bases.push_back(before[at]);
+            if (at > 0 && before[at - 1] != bases[0])
+            {
+                bases.push_back(before[at - 1]);
+            }
+            if (at + 1 < before.size() && find(bases.begin(), bases.end(), before[at + 1]) == bases.end())
+            {
+                bases.push_back(before[at + 1]);
+            }
+            for (auto& old: bases)
+            {
+                baseHolders[old];
+            }
+        }
+        log->info("{} changed since version {}", file.first, get<0>(previous));
+    }
+
+    vector<string> wanted;
+    for (auto& base: baseHolders)
+    {
+        wanted.push_back(base.first);
+    }
+    for (int i = 0; i < num_servers; i++)
+    {
+        try {
+            for (size_t start = 0; start < wanted.size(); start += HAS_BLOCKS_BATCH)
+            {
+                vector<string> batch(wanted.begin() + start,
+                        wanted.begin() + min(wanted.size(), start + HAS_BLOCKS_BATCH));
+                vector<string> present = clients[i]->call("has_blocks", batch).as<vector<string>>();
+                for (auto& hash: present)
+                {
+                    baseHolders[hash].push_back(i);
+                }
+            }
+        } catch (std::exception &e) {
+            // deltas just won't be sent to this server
+            log->error("Unable to find delta bases on server {}: {}", i, e.what());
+        }
+    }
+}
+
+// the server to send a block as a delta to: one holding the block at the
+// same position of the previous version, preferring the one placement chose,
+// else the one expected to finish first. -1 if there is none.
+int Uploader::deltaServer(int server, const string& hash)
+{
+    auto base = deltaBase.find(hash);
+    if (base == deltaBase.end())
+    {
+        return -1;
+    }
+    const vector<int>& holders = baseHolders[base->second[0]];
+    if (find(holders.begin(), holders.end(), server) != holders.end())
+    {
+        return server;
+    }
+    size_t bytes = blockStore[hash].size();
+    int best = -1;
+    for (int holder: holders)
+    {
+        if (best < 0 || load.estimate(holder, bytes) < load.estimate(best, bytes))
+        {
+            best = holder;
+        }
+    }
+    return best;
+}
+
+// sends a block as a delta if that is much smaller than the block; returns
+// the server's in-flight count, or -1 if the block still has to be sent whole
+int Uploader::storeDelta(int server, const string& hash, vector<rpc::client*>& clients, size_t& sent)
+{
+    auto base = deltaBase.find(hash);
+    if (base == deltaBase.end())
+    {
+        return -1;
+    }
+
+    // signatures of the previous version's blocks this server holds
+    unordered_map<string, vector<BlockSignature>>& cache = sigCache[server];
+    vector<string> missing;
+    for (auto& old: base->second)
+    {
+        if (cache.count(old) == 0)
+        {
+            missing.push_back(old);
+        }
+    }
+    if (!missing.empty())
+    {
+        vector<BlockSignature> sigs = clients[server]->call("get_signatures", missing,
+                delta_chunk).as<vector<BlockSignature>>();
+        for (auto& old: missing)
+        {
+            cache[old];
+        }
+        for (auto& sig: sigs)
+        {
+            cache[get<0>(sig)].push_back(sig);
+        }
+    }
+
+    // match against the block at the same position alone first; its
+    // neighbours are only indexed too if that leaves the delta too large
+    const string& data = blockStore[hash];
+    vector<DeltaOp> ops;
+    size_t size = data.size();
+    vector<BlockSignature> sigs;
+    for (size_t n = 0; n < base->second.size(); n++)
+    {
+        const vector<BlockSignature>& more = cache[base->second[n]];
+        sigs.insert(sigs.end(), more.begin(), more.end());
+        if (n > 0 && n + 1 < base->second.size())
+        {
+            continue;
+        }
+        if (!sigs.empty())
+        {
+            size_t literal;
+            ops = compute_delta(data, sigs, literal);
+            size = delta_size(ops);
+        }
+        if (size <= data.size() / 2)
+        {
+            break;
+        }
+    }
+    if (ops.empty() || size > data.size() / 2)
+    {
+        return -1;
+    }
+
+    int inflight = clients[server]->call("store_delta", hash, ops).as<int>();
+    if (inflight >= 0)
+    {
+        deltaSaved += data.size() - size;
+        sent = size;
+    }
+    return inflight;
+}
+
+// packs files below pack_threshold back to back into segment blocks of up
+// to blocksize bytes; each file's block list is a single extent of its segment
+void Uploader::packSmallFiles(const vector<string>& filenames, FileInfoMap& clientMap)
+{
+    auto log = logger();
+
+    string segment;
+    vector<pair<string, size_t>> members; // filename and offset in segment
+
+    auto seal = [&]() {
+        if (members.empty()) {
+            return;
+        }
+        string hash = picosha2::hash256_hex_string(segment);
+        // only empty files: no segment, each is one empty block, as
+        // create_fileinfos makes them
+        if (segment.empty()) {
+            for (auto& member: members) {
+                clientMap[member.first] = make_tuple(1, list<string>(1, hash));
+            }
+            blockStore[hash] = segment;
+            members.clear();
+            return;
+        }
+        for (size_t i = 0; i < members.size(); i++) {
+            size_t end = i + 1 < members.size() ? members[i + 1].second : segment.size();
+            list<string> extent;
+            extent.push_back(make_extent(hash, members[i].second, end - members[i].second));
+            clientMap[members[i].first] = make_tuple(1, extent);
+        }
+        log->info("packed {} files into segment {}", members.size(), hash);
+        blockStore[hash] = segment;
+        segment.clear();
+        members.clear();
+    };
+
+    // read a window of files at a time with all of it in flight, then pack
+    // them in order
+    for (size_t first = 0; first < filenames.size(); first += FILE_WINDOW) {
+        size_t count = min(FILE_WINDOW, filenames.size() - first);
+
+        vector<IORequest> opens;
+        for (size_t i = 0; i < count; i++) {
+            opens.push_back(IORequest::open(base_dir + "/" + filenames[first + i], O_RDONLY));
+        }
+        io->submit(opens);
+
+        vector<string> data(count);
+        vector<IORequest> reads;
+        vector<size_t> readers; // the file each read is for
+        for (size_t i = 0; i < count; i++) {
+            struct stat st;
+            int fd = (int) opens[i].result;
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                continue;
+            }
+            data[i].resize(st.st_size);
+            reads.push_back(IORequest::read(fd, 0, &data[i][0], data[i].size()));
+            readers.push_back(i);
+        }
+        io->submit(reads);
+
+        for (size_t r = 0; r < reads.size(); r++) {
+            size_t i = readers[r];
+            if (reads[r].result < 0) {
+                log->error("Error reading {}: {}", filenames[first + i], strerror((int) -reads[r].result));
+                continue;
+            }
+            // a file that shrank while we read it ends early
+            data[i].resize(reads[r].result);
+            if (segment.size() + data[i].size() > (size_t) blocksize) {
+                seal();
+            }
+            members.push_back(make_pair(filenames[first + i], segment.size()));
+            segment.append(data[i]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (opens[i].result >= 0) {
+                close((int) opens[i].result);
+            }
+        }
+    }
+    seal();
+}
+
+// the blocks behind a block list that this upload has not placed yet; a
+// segment shared by many packed files is only sent once
+list<string> Uploader::newBlocks(const FileInfo& finfo)
+{
+    list<string> blocks;
+    for (auto& ref: get<1>(finfo)) {
+        string hash = block_of(ref);
+        if (placed.insert(hash).second) {
+            blocks.push_back(hash);
+        }
+    }
+    return blocks;
+}
+
+// sends a file's FileInfo to the servers owning its metadata (every server
+// unless metadata is sharded), update_batch files at a time
+void Uploader::commitFile(const string& filename, const FileInfo& finfo, vector<rpc::client*>& clients)
+{
+    if (update_batch <= 1) {
+        for (int i: metadata_owners(filename, num_servers, metadata_replicas))
+        {
+            clients[i]->call("update_file", filename, finfo);
+        }
+        return;
+    }
+
+    pendingUpdates[filename] = finfo;
+    if ((int) pendingUpdates.size() >= update_batch) {
+        flushUpdates(clients);
+    }
+}
+
+void Uploader::flushUpdates(vector<rpc::client*>& clients)
+{
+    if (pendingUpdates.empty()) {
+        return;
+    }
+
+    // one update_files per server with the files it owns
+    vector<FileInfoMap> batches(num_servers);
+    for (auto& file: pendingUpdates)
+    {
+        for (int i: metadata_owners(file.first, num_servers, metadata_replicas))
+        {
+            batches[i].insert(file);
+        }
+    }
+    for (int i = 0; i < num_servers; i++)
+    {
+        if (!batches[i].empty())
+        {
+            clients[i]->call("update_files", batches[i]);
+        }
+    }
+    pendingUpdates.clear();
 }
 
 void Uploader::policySelector(FileInfoMap clientMap, double rtt[], vector<rpc::client*> clients)
@@ -369,6 +938,10 @@ void Uploader::policySelector(FileInfoMap clientMap, double rtt[], vector<rpc::c
         policyLocalFarthest(clientMap, rtt, clients);
         return;
     }
+    else if(policy.compare("twochoice") == 0) {
+        policyTwoChoice(clientMap, clients);
+        return;
+    }
     else {
         log->error("invalid policy");
         return;
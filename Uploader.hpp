@@ -3,11 +3,16 @@
 
 #include <string>
 #include <vector>
+#include <unordered_set>
+#include <memory>
 
 #include "inih/INIReader.h"
 #include "rpc/client.h"
 
 #include "SurfStoreTypes.hpp"
+#include "ServerLoad.hpp"
+#include "DiskIO.hpp"
+#include "BloomFilter.hpp"
 #include "logger.hpp"
 
 using namespace std;
@@ -22,6 +27,11 @@ public:
 	const uint64_t RPC_TIMEOUT = 10000; // milliseconds
 
     list<string> create_fileinfo(string filename);
+    void create_fileinfos(const vector<string>& filenames, FileInfoMap& clientMap);
+
+    const size_t FILE_WINDOW = 256; // files open at once while chunking
+    const size_t HAS_BLOCKS_BATCH = 10000; // hashes per has_blocks call
+    const size_t HASH_BYTES = 66; // a hash as has_blocks sends it
 
     void policySelector(FileInfoMap clientMap, double rtt[], vector<rpc::client*> clients);
     void policyRandom(FileInfoMap clientMap, vector<rpc::client*> clients);
@@ -29,6 +39,20 @@ public:
     void policyLocal(FileInfoMap clientMap, vector<rpc::client*> clients);
     void policyLocalClosest(FileInfoMap clientMap, double rtt[], vector<rpc::client*> clients);
     void policyLocalFarthest(FileInfoMap clientMap, double rtt[], vector<rpc::client*> clients);
+    void policyTwoChoice(FileInfoMap clientMap, vector<rpc::client*> clients);
+
+    // sends one block to a server, recording its throughput and queue depth
+    void storeBlock(int server, const string& hash, vector<rpc::client*>& clients);
+
+    void findExistingBlocks(const FileInfoMap& clientMap, vector<rpc::client*>& clients);
+    void findDeltaBases(FileInfoMap& clientMap, vector<rpc::client*>& clients);
+    int deltaServer(int server, const string& hash);
+    int storeDelta(int server, const string& hash, vector<rpc::client*>& clients, size_t& sent);
+
+    void packSmallFiles(const vector<string>& filenames, FileInfoMap& clientMap);
+    list<string> newBlocks(const FileInfo& finfo);
+    void commitFile(const string& filename, const FileInfo& finfo, vector<rpc::client*>& clients);
+    void flushUpdates(vector<rpc::client*>& clients);
           
 protected:
 
@@ -37,13 +61,35 @@ protected:
 	string base_dir;
 	int blocksize;
 	string policy;
+	int pack_threshold; // bytes, 0 disables packing
+	int update_batch;
+	bool delta;
+	int delta_chunk; // bytes per signature chunk
+	int io_depth; // file reads in flight
+	bool dedup; // skip blocks some server already holds
 
 	int num_servers;
+	int metadata_replicas; // servers per metadata shard, 0 if unsharded
 	vector<string> ssdhosts;
 	vector<int> ssdports;
 
     int local; // index of local server
     unordered_map<string, string> blockStore; // store blocks
+    ServerLoad load; // measured throughput and in-flight count per server
+    unordered_set<string> placed; // blocks already sent during this upload
+    FileInfoMap pendingUpdates; // commits waiting for the next update_files
+
+    // new block -> blocks of the previous version it can be a delta against,
+    // the one at the same position first
+    unordered_map<string, vector<string>> deltaBase;
+    // block of a previous version -> servers holding it
+    unordered_map<string, vector<int>> baseHolders;
+    // per server: block hash -> its signatures there
+    vector<unordered_map<string, vector<BlockSignature>>> sigCache;
+    size_t deltaSaved; // bytes not sent thanks to deltas
+    unique_ptr<DiskIO> io;
+
+    size_t dedupSkipped; // bytes not sent because a server had them
 };
 
 #endif // UPLOADER_HPP
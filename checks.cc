@@ -0,0 +1,258 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <random>
+#include <sysexits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "inih/INIReader.h"
+#include "picosha2/picosha2.h"
+
+#include "logger.hpp"
+#include "SurfStoreTypes.hpp"
+#include "MetadataStore.hpp"
+#include "Delta.hpp"
+#include "BloomFilter.hpp"
+
+using namespace std;
+
+// Behaviour checks for the pure logic under the client and server: round
+// trips that must give back what went in, and recovery from damage the
+// disk can leave behind. Prints each failure and exits non-zero if any.
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            cerr << __FILE__ << ":" << __LINE__ << ": check failed: " << #cond << endl; \
+            failures++; \
+        } \
+    } while (0)
+
+static off_t file_size(const string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+static void remove_tree(const string& path)
+{
+    DIR* dirp = opendir(path.c_str());
+    if (dirp != NULL) {
+        struct dirent* dp;
+        while ((dp = readdir(dirp)) != NULL) {
+            string name(dp->d_name);
+            if (name != "." && name != "..") {
+                remove_tree(path + "/" + name);
+            }
+        }
+        closedir(dirp);
+        rmdir(path.c_str());
+    } else {
+        unlink(path.c_str());
+    }
+}
+
+static FileInfo make_info(int version, const string& seed)
+{
+    list<string> hashes;
+    for (int i = 0; i < 3; i++) {
+        hashes.push_back(seed + "-" + to_string(i));
+    }
+    return make_tuple(version, hashes);
+}
+
+// a packed file's extent names its segment, offset and length, and a plain
+// block hash is not mistaken for one
+static void check_extents()
+{
+    string hash(64, 'a');
+    size_t offsets[] = { 0, 1, 16383, (size_t) 1 << 40 };
+    for (size_t offset: offsets) {
+        string ref = make_extent(hash, offset, offset + 7);
+        string segment;
+        size_t got_offset = 0, got_length = 0;
+        CHECK(parse_extent(ref, segment, got_offset, got_length));
+        CHECK(segment == hash);
+        CHECK(got_offset == offset);
+        CHECK(got_length == offset + 7);
+        CHECK(block_of(ref) == hash);
+    }
+
+    string segment;
+    size_t offset, length;
+    CHECK(!parse_extent(hash, segment, offset, length));
+    CHECK(!parse_extent("0", segment, offset, length));
+    CHECK(block_of(hash) == hash);
+}
+
+// a delta against the previous version of a block rebuilds the new one
+// exactly, and costs little when little changed
+static void check_delta()
+{
+    mt19937_64 rng(42);
+    string base(16384, '\0');
+    for (auto& c: base) {
+        c = (char) (rng() & 0xff);
+    }
+    string hash = "base";
+    unordered_map<string, BlockBuffer> sources;
+    sources[hash] = BlockBuffer(string(base));
+    vector<BlockSignature> sigs = compute_signatures(hash, base, 1024);
+
+    // unchanged, edited in place, shifted by an insert, cut short, emptied
+    string edited = base;
+    edited[5000] ^= 1;
+    vector<string> versions;
+    versions.push_back(base);
+    versions.push_back(edited);
+    versions.push_back(base.substr(0, 3000) + "inserted" + base.substr(3000));
+    versions.push_back(base.substr(0, 9000));
+    versions.push_back(string());
+    for (auto& data: versions) {
+        size_t literal = 0;
+        vector<DeltaOp> ops = compute_delta(data, sigs, literal);
+        string out;
+        CHECK(apply_delta(ops, sources, out));
+        CHECK(out == data);
+        CHECK(literal <= 2048 + 8);
+    }
+
+    size_t literal;
+    CHECK(compute_delta(base, sigs, literal).size() > 0 && literal == 0);
+
+    // a delta whose source the server lacks is refused, not half applied
+    string out;
+    vector<DeltaOp> ops = compute_delta(edited, sigs, literal);
+    CHECK(!apply_delta(ops, unordered_map<string, BlockBuffer>(), out));
+}
+
+// a Bloom filter never misses a block it was given, also once shipped to a
+// client as bits, and stays near the false positive rate it was sized for
+static void check_bloom_filter()
+{
+    const size_t n = 10000;
+    size_t bits = BloomFilter::bitsFor(n, 0.01);
+    BloomFilter filter(bits, BloomFilter::hashesFor(bits, n));
+    for (size_t i = 0; i < n; i++) {
+        filter.add(picosha2::hash256_hex_string("held-" + to_string(i)));
+    }
+    BloomFilter shipped;
+    shipped.assign(filter.bits(), filter.hashes());
+
+    size_t missed = 0;
+    size_t false_positives = 0;
+    for (size_t i = 0; i < n; i++) {
+        string held = picosha2::hash256_hex_string("held-" + to_string(i));
+        if (!filter.mayContain(held) || !shipped.mayContain(held)) {
+            missed++;
+        }
+        if (filter.mayContain(picosha2::hash256_hex_string("other-" + to_string(i)))) {
+            false_positives++;
+        }
+    }
+    CHECK(missed == 0);
+    CHECK(false_positives < n * 3 / 100);
+
+    CHECK(BloomFilter().mayContain(picosha2::hash256_hex_string("anything")));
+}
+
+// a crash mid-append leaves a partial record at the end of the log; it is
+// cut off on recovery and later updates are not lost behind it
+static void check_wal_torn_tail(const string& dir)
+{
+    string confpath = dir + "/checks.ini";
+    ofstream conf(confpath);
+    conf << "[ssd]\nmeta_dir=" << dir << "/meta\nwal_sync=false\n";
+    conf.close();
+    INIReader config(confpath);
+    string wal = dir + "/meta/server0/wal.1";
+
+    FileInfoMap written;
+    {
+        MetadataStore store(config, 0);
+        FileInfoMap fileMap;
+        store.recover(fileMap);
+        CHECK(fileMap.empty());
+        uint64_t ticket = 0;
+        for (int i = 0; i < 3; i++) {
+            string name = "file-" + to_string(i);
+            written[name] = make_info(1, name);
+            ticket = store.append(name, written[name]);
+        }
+        store.commit(ticket);
+    }
+    off_t intact = file_size(wal);
+    CHECK(intact > 0);
+
+    // a record header promising more bytes than follow it
+    int fd = open(wal.c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    const char torn[] = { 64, 0, 0, 0, 1, 2, 3, 4, 'f', 'i' };
+    CHECK(write(fd, torn, sizeof(torn)) == (ssize_t) sizeof(torn));
+    close(fd);
+
+    {
+        MetadataStore store(config, 0);
+        FileInfoMap fileMap;
+        store.recover(fileMap);
+        CHECK(fileMap == written);
+        CHECK(file_size(wal) == intact);
+
+        written["file-1"] = make_info(2, "changed");
+        store.commit(store.append("file-1", written["file-1"]));
+    }
+    {
+        MetadataStore store(config, 0);
+        FileInfoMap fileMap;
+        store.recover(fileMap);
+        CHECK(fileMap == written);
+
+        // and the same again once it is all folded into a snapshot
+        mutex mapLock;
+        store.snapshot(fileMap, mapLock);
+    }
+    {
+        MetadataStore store(config, 0);
+        FileInfoMap fileMap;
+        store.recover(fileMap);
+        CHECK(fileMap == written);
+    }
+}
+
+int main(int argc, char** argv) {
+	initLogging();
+	spdlog::set_level(spdlog::level::err);
+
+	if (argc > 1) {
+		cerr << "Usage: " << argv[0] << endl;
+		return EX_USAGE;
+	}
+
+	char tmpl[] = "/tmp/checks.XXXXXX";
+	if (mkdtemp(tmpl) == NULL) {
+		cerr << "Unable to create a scratch directory" << endl;
+		return EX_CANTCREAT;
+	}
+	string dir = tmpl;
+
+	check_extents();
+	check_delta();
+	check_bloom_filter();
+	check_wal_torn_tail(dir);
+
+	remove_tree(dir);
+	if (failures > 0) {
+		cerr << failures << " checks failed" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "all checks passed" << endl;
+	return 0;
+}
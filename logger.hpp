@@ -9,4 +9,12 @@ using namespace std;
 void initLogging();
 shared_ptr<spdlog::logger> logger();
 
+// per-request and per-block chatter; compiled out of release builds
+// (make RELEASE=1), where spans from Trace.hpp carry the timing instead
+#ifdef NDEBUG
+#define LOG_VERBOSE(...) do { if (false) { logger()->debug(__VA_ARGS__); } } while (0)
+#else
+#define LOG_VERBOSE(...) logger()->debug(__VA_ARGS__)
+#endif
+
 #endif // LOGGER_HPP
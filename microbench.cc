@@ -0,0 +1,318 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <random>
+#include <cmath>
+#include <sysexits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "inih/INIReader.h"
+#include "rpc/msgpack.hpp"
+#include "picosha2/picosha2.h"
+
+#include "logger.hpp"
+#include "SurfStoreTypes.hpp"
+#include "BlockBuffer.hpp"
+#include "FetchScheduler.hpp"
+#include "ServerLoad.hpp"
+#include "Uploader.hpp"
+
+using namespace std;
+
+// Microbenchmarks for the client and server hot paths. Each benchmark runs
+// once to warm up, then `iterations` timed runs; the summary goes to stdout
+// and, if a path is given, to a JSON file for comparing runs.
+
+struct Result {
+    string name;
+    string unit;       // what `work` counts
+    double work;       // units processed per run
+    vector<double> samples; // seconds per run
+};
+
+static double percentile(vector<double> sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    double rank = p * (sorted.size() - 1);
+    size_t lo = (size_t) floor(rank);
+    size_t hi = (size_t) ceil(rank);
+    return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+}
+
+static Result run(const string& name, const string& unit, double work, int iterations,
+                  function<void()> body)
+{
+    Result r;
+    r.name = name;
+    r.unit = unit;
+    r.work = work;
+
+    body(); // warm up caches and allocators
+    for (int i = 0; i < iterations; i++) {
+        chrono::time_point<chrono::steady_clock> start = chrono::steady_clock::now();
+        body();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        r.samples.push_back(elapsed.count());
+    }
+    return r;
+}
+
+static string random_bytes(mt19937_64& rng, size_t n)
+{
+    string s(n, '\0');
+    for (size_t i = 0; i < n; i++) {
+        s[i] = (char) (rng() & 0xff);
+    }
+    return s;
+}
+
+// chunk and hash a file through Uploader::create_fileinfo
+static Result bench_chunking(int iterations, const string& dir, mt19937_64& rng)
+{
+    const size_t filesize = 64 << 20;
+    const int blocksize = 16384;
+
+    string confpath = dir + "/microbench.ini";
+    ofstream conf(confpath);
+    conf << "[uploader]\nbase_dir=" << dir << "\nblocksize=" << blocksize
+         << "\npolicy=random\n[ssd]\nnum_servers=1\nserver0=localhost:8001\n";
+    conf.close();
+
+    ofstream data(dir + "/chunking.bin", ios::binary);
+    string bytes = random_bytes(rng, filesize);
+    data.write(bytes.data(), bytes.size());
+    data.close();
+
+    INIReader config(confpath);
+    Uploader uploader(config, 0);
+    return run("chunk_and_hash_64MiB", "bytes", filesize, iterations, [&]() {
+        uploader.create_fileinfo("chunking.bin");
+    });
+}
+
+static FileInfoMap make_fileinfo_map(mt19937_64& rng, int files, int blocks)
+{
+    FileInfoMap m;
+    for (int i = 0; i < files; i++) {
+        list<string> hashes;
+        for (int j = 0; j < blocks; j++) {
+            hashes.push_back(picosha2::hash256_hex_string(random_bytes(rng, 16)));
+        }
+        m["dir/file-" + to_string(i) + ".dat"] = make_tuple(1, hashes);
+    }
+    return m;
+}
+
+static void bench_msgpack(int iterations, mt19937_64& rng, vector<Result>& results)
+{
+    const int files = 10000;
+    const int blocks = 8;
+    FileInfoMap m = make_fileinfo_map(rng, files, blocks);
+
+    clmdep_msgpack::sbuffer encoded;
+    clmdep_msgpack::pack(encoded, m);
+
+    results.push_back(run("fileinfomap_encode_10k", "files", files, iterations, [&]() {
+        clmdep_msgpack::sbuffer buf;
+        clmdep_msgpack::pack(buf, m);
+    }));
+    results.push_back(run("fileinfomap_decode_10k", "files", files, iterations, [&]() {
+        clmdep_msgpack::object_handle oh = clmdep_msgpack::unpack(encoded.data(), encoded.size());
+        FileInfoMap decoded = oh.get().as<FileInfoMap>();
+    }));
+}
+
+// the server's blockStore: one map behind one mutex, hit by rpc threads
+static void bench_blockstore(int iterations, mt19937_64& rng, vector<Result>& results)
+{
+    const int threads = 4;
+    const int per_thread = 50000;
+
+    vector<vector<string>> keys(threads);
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < per_thread; i++) {
+            keys[t].push_back(picosha2::hash256_hex_string(random_bytes(rng, 16)));
+        }
+    }
+    string block = random_bytes(rng, 16384);
+
+    unordered_map<string, BlockBuffer> blockStore;
+    mutex storeLock;
+
+    auto parallel = [&](function<void(int)> work) {
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.push_back(thread(work, t));
+        }
+        for (auto& w: workers) {
+            w.join();
+        }
+    };
+
+    results.push_back(run("blockstore_insert_4x50k", "ops", threads * per_thread, iterations, [&]() {
+        {
+            lock_guard<mutex> lock(storeLock);
+            blockStore.clear();
+        }
+        parallel([&](int t) {
+            for (auto& key: keys[t]) {
+                string copy = block;
+                lock_guard<mutex> lock(storeLock);
+                blockStore[key] = BlockBuffer(std::move(copy));
+            }
+        });
+    }));
+
+    results.push_back(run("blockstore_lookup_4x50k", "ops", threads * per_thread, iterations, [&]() {
+        parallel([&](int t) {
+            size_t found = 0;
+            for (auto& key: keys[t]) {
+                lock_guard<mutex> lock(storeLock);
+                auto it = blockStore.find(key);
+                if (it != blockStore.end()) {
+                    BlockBuffer shared = it->second;
+                    found += shared.size();
+                }
+            }
+            if (found == 0) {
+                cerr << "lookup found nothing" << endl;
+            }
+        });
+    }));
+}
+
+// the downloader's block matching: index every block's replicas and drain
+// the schedule with one stream per server
+static Result bench_matching(int iterations, mt19937_64& rng)
+{
+    const int servers = 4;
+    const int blocks = 100000;
+
+    vector<string> hashes;
+    vector<vector<int>> replicas;
+    for (int i = 0; i < blocks; i++) {
+        hashes.push_back(picosha2::hash256_hex_string(random_bytes(rng, 16)));
+        vector<int> held;
+        for (int s = 0; s < servers; s++) {
+            if (rng() % 2 == 0) {
+                held.push_back(s);
+            }
+        }
+        if (held.empty()) {
+            held.push_back((int) (rng() % servers));
+        }
+        replicas.push_back(held);
+    }
+
+    ServerLoad load;
+    load.reset(servers);
+    return run("block_matching_100k", "blocks", blocks, iterations, [&]() {
+        FetchScheduler scheduler(servers, load, 16384);
+        for (int i = 0; i < blocks; i++) {
+            scheduler.add(hashes[i], replicas[i]);
+        }
+        string hash;
+        for (int s = 0; s < servers; s++) {
+            while (scheduler.next(s, hash)) {
+                scheduler.complete(s, hash);
+            }
+        }
+    });
+}
+
+static void report(const vector<Result>& results, const string& jsonpath)
+{
+    stringstream json;
+    json << "{\n  \"benchmarks\": [\n";
+
+    printf("%-28s %10s %10s %10s %10s %10s %14s\n",
+           "benchmark", "min(ms)", "median", "mean", "p95", "stddev", "throughput/s");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        vector<double> sorted = r.samples;
+        sort(sorted.begin(), sorted.end());
+
+        double mean = 0;
+        for (double s: sorted) {
+            mean += s;
+        }
+        mean /= sorted.size();
+        double var = 0;
+        for (double s: sorted) {
+            var += (s - mean) * (s - mean);
+        }
+        double stddev = sorted.size() > 1 ? sqrt(var / (sorted.size() - 1)) : 0;
+        double median = percentile(sorted, 0.5);
+        double p95 = percentile(sorted, 0.95);
+
+        printf("%-28s %10.3f %10.3f %10.3f %10.3f %10.3f %14.0f %s\n",
+               r.name.c_str(), sorted.front() * 1e3, median * 1e3, mean * 1e3,
+               p95 * 1e3, stddev * 1e3, r.work / median, r.unit.c_str());
+
+        json << "    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit
+             << "\", \"work\": " << r.work << ", \"iterations\": " << sorted.size()
+             << ", \"min\": " << sorted.front() << ", \"median\": " << median
+             << ", \"mean\": " << mean << ", \"p95\": " << p95
+             << ", \"max\": " << sorted.back() << ", \"stddev\": " << stddev
+             << ", \"throughput\": " << r.work / median << ", \"samples\": [";
+        for (size_t j = 0; j < r.samples.size(); j++) {
+            json << (j ? ", " : "") << r.samples[j];
+        }
+        json << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+
+    if (jsonpath != "") {
+        ofstream out(jsonpath);
+        out << json.str();
+    }
+}
+
+int main(int argc, char** argv) {
+	initLogging();
+	spdlog::set_level(spdlog::level::err);
+
+	if (argc > 3) {
+		cerr << "Usage: " << argv[0] << " [iterations] [json_file]" << endl;
+		return EX_USAGE;
+	}
+	int iterations = argc > 1 ? (int) strtol(argv[1], NULL, 10) : 10;
+	string jsonpath = argc > 2 ? argv[2] : "";
+	if (iterations <= 0) {
+		cerr << "Invalid iteration count " << argv[1] << endl;
+		return EX_USAGE;
+	}
+
+	char tmpl[] = "/tmp/microbench.XXXXXX";
+	if (mkdtemp(tmpl) == NULL) {
+		cerr << "Unable to create a scratch directory" << endl;
+		return EX_CANTCREAT;
+	}
+	string dir = tmpl;
+
+	// fixed seed so every run sees the same inputs
+	mt19937_64 rng(42);
+	vector<Result> results;
+	results.push_back(bench_chunking(iterations, dir, rng));
+	bench_msgpack(iterations, rng, results);
+	bench_blockstore(iterations, rng, results);
+	results.push_back(bench_matching(iterations, rng));
+
+	report(results, jsonpath);
+
+	unlink((dir + "/chunking.bin").c_str());
+	unlink((dir + "/microbench.ini").c_str());
+	rmdir(dir.c_str());
+	return 0;
+}
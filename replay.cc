@@ -0,0 +1,453 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <random>
+#include <cmath>
+#include <memory>
+#include <sysexits.h>
+#include <stdlib.h>
+
+#include "inih/INIReader.h"
+#include "rpc/client.h"
+#include "picosha2/picosha2.h"
+
+#include "logger.hpp"
+#include "SurfStoreTypes.hpp"
+#include "Placement.hpp"
+#include "RpcRecorder.hpp"
+
+using namespace std;
+
+// Drives ssd servers with a recorded rpc stream (see RpcRecorder) or with
+// synthetic uploads and downloads, then reports latency per rpc. Block
+// contents come from a fixed random pool, so a given seed or recording
+// always produces the same requests.
+
+typedef chrono::steady_clock steady;
+
+static const size_t POOL_SIZE = 8 << 20;
+static const uint64_t RPC_TIMEOUT = 10000; // milliseconds
+
+struct Settings {
+    string mode;
+    vector<string> traceFiles;
+    double speed; // 0 replays as fast as possible
+    int threads;
+    uint64_t seed;
+    int requests;
+    double rate; // synthetic ops per second, 0 unthrottled
+    int blocksize;
+    int minFileSize;
+    int maxFileSize;
+    double zipf;
+    double dedupRatio;
+    double readRatio;
+    vector<string> hosts;
+    vector<int> ports;
+};
+
+struct Stats {
+    vector<double> latencies; // seconds
+    uint64_t bytes;
+    uint64_t errors;
+    Stats() : bytes(0), errors(0) {}
+};
+
+// one worker's connections and measurements
+class Worker {
+public:
+    Worker(const Settings& t_settings, const string& t_pool)
+        : settings(t_settings), pool(t_pool), clients(t_settings.hosts.size()) {}
+
+    int owner(const string& key)
+    {
+        return metadata_owners(key, (int) settings.hosts.size(), 1)[0];
+    }
+
+    rpc::client& client(int server)
+    {
+        if (!clients[server]) {
+            clients[server].reset(new rpc::client(settings.hosts[server], settings.ports[server]));
+            clients[server]->set_timeout(RPC_TIMEOUT);
+        }
+        return *clients[server];
+    }
+
+    // times `body` as one `rpc`; a failed call drops the connection
+    template <typename F>
+    void timed(const string& rpc, int server, uint64_t bytes, F body)
+    {
+        Stats& s = stats[rpc];
+        steady::time_point start = steady::now();
+        try {
+            body(client(server));
+        } catch (std::exception &e) {
+            s.errors++;
+            clients[server].reset();
+            return;
+        }
+        s.latencies.push_back(chrono::duration<double>(steady::now() - start).count());
+        s.bytes += bytes;
+    }
+
+    // `size` bytes of pool content picked by `id`
+    string content(uint64_t id, size_t size)
+    {
+        size = min(size, pool.size());
+        size_t offset = (size_t) ((id * 0x9e3779b97f4a7c15ULL) % (pool.size() - size + 1));
+        return pool.substr(offset, size);
+    }
+
+    void storeBlock(const string& hash, const string& data)
+    {
+        timed("store_block", owner(hash), data.size(), [&](rpc::client& c) {
+            c.call("store_block", hash, data);
+        });
+    }
+
+    void getBlock(const string& hash)
+    {
+        timed("get_block", owner(hash), 0, [&](rpc::client& c) {
+            stats["get_block"].bytes += c.call("get_block", hash).as<string>().size();
+        });
+    }
+
+    void updateFile(const string& filename, const FileInfo& finfo)
+    {
+        timed("update_file", owner(filename), 0, [&](rpc::client& c) {
+            c.call("update_file", filename, finfo);
+        });
+    }
+
+    void replay(const vector<RecordedRpc>& records);
+    void synthetic(int requests, int index);
+
+    unordered_map<string, Stats> stats;
+
+private:
+    const Settings& settings;
+    const string& pool;
+    vector<unique_ptr<rpc::client>> clients;
+};
+
+void Worker::replay(const vector<RecordedRpc>& records)
+{
+    unordered_map<string, int> versions;
+    vector<string> recent; // block hashes this worker stored, newest last
+    steady::time_point begin = steady::now();
+    size_t next = 0;
+
+    for (auto& r: records) {
+        if (settings.speed > 0) {
+            this_thread::sleep_until(begin + chrono::microseconds(
+                (uint64_t) (r.start_us / settings.speed)));
+        }
+        int any = (int) (next++ % settings.hosts.size());
+
+        if (r.rpc == "store_block" || r.rpc == "store_delta") {
+            // deltas can't be rebuilt from a recording, send the block whole
+            storeBlock(r.key, content(placement_hash(r.key, 0), r.bytes));
+            recent.push_back(r.key);
+            if (recent.size() > 1024) {
+                recent.erase(recent.begin(), recent.begin() + 512);
+            }
+        } else if (r.rpc == "get_block") {
+            getBlock(r.key);
+        } else if (r.rpc == "get_signatures" || r.rpc == "has_blocks" ||
+                   r.rpc == "referenced_blocks") {
+            vector<string> hashes(recent.end() - min(recent.size(), (size_t) r.bytes), recent.end());
+            timed(r.rpc, owner(hashes.empty() ? r.key : hashes[0]), 0, [&](rpc::client& c) {
+                if (r.rpc != "get_signatures") {
+                    c.call(r.rpc, hashes);
+                } else {
+                    c.call("get_signatures", hashes, 1024);
+                }
+            });
+        } else if (r.rpc == "update_file") {
+            list<string> blocks(recent.end() - min(recent.size(), (size_t) r.bytes), recent.end());
+            updateFile(r.key, make_tuple(++versions[r.key], blocks));
+        } else if (r.rpc == "update_files") {
+            vector<FileInfoMap> batches(settings.hosts.size());
+            for (uint64_t i = 0; i < r.bytes; i++) {
+                string filename = to_string(r.start_us) + "-" + to_string(i);
+                batches[owner(filename)][filename] = make_tuple(++versions[filename], list<string>());
+            }
+            for (size_t i = 0; i < batches.size(); i++) {
+                if (!batches[i].empty()) {
+                    timed(r.rpc, (int) i, 0, [&](rpc::client& c) {
+                        c.call("update_files", batches[i]);
+                    });
+                }
+            }
+        } else if (r.rpc == "get_block_filter") {
+            // bytes is the filter the server sent, 0 if it refused
+            timed(r.rpc, any, 0, [&](rpc::client& c) {
+                c.call("get_block_filter", r.bytes);
+            });
+        } else if (r.rpc == "file_version" || r.rpc == "lease_file") {
+            timed(r.rpc, owner(r.key), 0, [&](rpc::client& c) {
+                c.call(r.rpc, r.key);
+            });
+        } else if (r.rpc == "get_fileinfo_map" || r.rpc == "lease_fileinfo_map" ||
+                   r.rpc == "get_block_list") {
+            timed(r.rpc, any, 0, [&](rpc::client& c) {
+                c.call(r.rpc);
+            });
+        } else {
+            stats["unknown:" + r.rpc].errors++;
+        }
+    }
+}
+
+// writes whole files of Zipf-distributed size, each block repeating earlier
+// content with probability dedupRatio, and reads back files already written
+void Worker::synthetic(int requests, int index)
+{
+    mt19937_64 rng(settings.seed + index);
+    uniform_real_distribution<double> uniform(0, 1);
+
+    // size classes minFileSize * rank, rank 1 the most likely
+    int ranks = max(1, settings.maxFileSize / settings.minFileSize);
+    vector<double> cdf;
+    double total = 0;
+    for (int k = 1; k <= ranks; k++) {
+        total += 1 / pow(k, settings.zipf);
+        cdf.push_back(total);
+    }
+
+    vector<uint64_t> contents; // content ids written so far
+    vector<pair<string, list<string>>> files;
+    uint64_t nextContent = (uint64_t) index << 40;
+    steady::time_point begin = steady::now();
+    double interval = settings.rate > 0 ? settings.threads / settings.rate : 0;
+
+    for (int op = 0; op < requests; op++) {
+        if (interval > 0) {
+            this_thread::sleep_until(begin + chrono::microseconds((uint64_t) (op * interval * 1e6)));
+        }
+
+        if (!files.empty() && uniform(rng) < settings.readRatio) {
+            auto& file = files[rng() % files.size()];
+            for (auto& hash: file.second) {
+                getBlock(hash);
+            }
+            continue;
+        }
+
+        int rank = (int) (lower_bound(cdf.begin(), cdf.end(), uniform(rng) * total) - cdf.begin()) + 1;
+        size_t size = (size_t) settings.minFileSize * rank;
+        string filename = "synthetic-" + to_string(index) + "-" + to_string(files.size());
+        list<string> blocks;
+        for (size_t off = 0; off < size; off += settings.blocksize) {
+            uint64_t id;
+            if (!contents.empty() && uniform(rng) < settings.dedupRatio) {
+                id = contents[rng() % contents.size()];
+            } else {
+                id = nextContent++;
+                contents.push_back(id);
+            }
+            string data = content(id, min((size_t) settings.blocksize, size - off));
+            string hash = picosha2::hash256_hex_string(data);
+            storeBlock(hash, data);
+            blocks.push_back(hash);
+        }
+        updateFile(filename, make_tuple(1, blocks));
+        files.push_back(make_pair(filename, blocks));
+    }
+}
+
+static bool loadSettings(INIReader& config, Settings& s)
+{
+    auto log = logger();
+
+    s.mode = config.Get("replay", "mode", "synthetic");
+    stringstream files(config.Get("replay", "trace_file", ""));
+    string file;
+    while (getline(files, file, ',')) {
+        if (!file.empty()) {
+            s.traceFiles.push_back(file);
+        }
+    }
+    s.speed = config.GetReal("replay", "speed", 1);
+    s.threads = (int) config.GetInteger("replay", "threads", 4);
+    s.seed = (uint64_t) config.GetInteger("replay", "seed", 42);
+    s.requests = (int) config.GetInteger("replay", "requests", 10000);
+    s.rate = config.GetReal("replay", "rate", 0);
+    s.blocksize = (int) config.GetInteger("replay", "blocksize", 16384);
+    s.minFileSize = (int) config.GetInteger("replay", "min_file_size", 1024);
+    s.maxFileSize = (int) config.GetInteger("replay", "max_file_size", 16 << 20);
+    s.zipf = config.GetReal("replay", "zipf", 1.2);
+    s.dedupRatio = config.GetReal("replay", "dedup_ratio", 0.3);
+    s.readRatio = config.GetReal("replay", "read_ratio", 0.5);
+
+    if ((s.mode != "trace" && s.mode != "synthetic") ||
+        (s.mode == "trace" && s.traceFiles.empty())) {
+        log->error("Invalid replay mode {} (trace needs trace_file)", s.mode);
+        return false;
+    }
+    if (s.speed < 0 || s.threads <= 0 || s.requests < 0 || s.rate < 0 || s.blocksize <= 0 ||
+        s.minFileSize <= 0 || s.maxFileSize < s.minFileSize || s.zipf < 0 ||
+        s.dedupRatio < 0 || s.dedupRatio > 1 || s.readRatio < 0 || s.readRatio > 1) {
+        log->error("Invalid replay settings");
+        return false;
+    }
+
+    // replay targets default to the configured servers
+    stringstream servers(config.Get("replay", "servers", ""));
+    string server;
+    while (getline(servers, server, ',')) {
+        s.hosts.push_back(server);
+    }
+    if (s.hosts.empty()) {
+        int num_servers = (int) config.GetInteger("ssd", "num_servers", -1);
+        for (int i = 0; i < num_servers; ++i) {
+            s.hosts.push_back(config.Get("ssd", "server"+std::to_string(i), ""));
+        }
+    }
+    for (auto& host: s.hosts) {
+        size_t idx = host.find(":");
+        if (idx == string::npos) {
+            log->error("Config line {} is invalid", host);
+            return false;
+        }
+        s.ports.push_back((int) strtol(host.substr(idx+1).c_str(), nullptr, 0));
+        host = host.substr(0, idx);
+    }
+    if (s.hosts.empty()) {
+        log->error("No servers to replay against");
+        return false;
+    }
+    return true;
+}
+
+static double percentile(const vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[(size_t) (p * (sorted.size() - 1))];
+}
+
+static void report(vector<unique_ptr<Worker>>& workers, double seconds)
+{
+    map<string, Stats> merged;
+    for (auto& w: workers) {
+        for (auto& s: w->stats) {
+            Stats& m = merged[s.first];
+            m.latencies.insert(m.latencies.end(), s.second.latencies.begin(), s.second.latencies.end());
+            m.bytes += s.second.bytes;
+            m.errors += s.second.errors;
+        }
+    }
+
+    printf("%-20s %10s %8s %10s %10s %10s %10s %12s\n",
+           "rpc", "calls", "errors", "ops/s", "mean(ms)", "p50", "p99", "MB/s");
+    for (auto& m: merged) {
+        vector<double>& lat = m.second.latencies;
+        sort(lat.begin(), lat.end());
+        double mean = 0;
+        for (double l: lat) {
+            mean += l;
+        }
+        mean = lat.empty() ? 0 : mean / lat.size();
+        printf("%-20s %10zu %8llu %10.1f %10.3f %10.3f %10.3f %12.2f\n",
+               m.first.c_str(), lat.size(), (unsigned long long) m.second.errors,
+               lat.size() / seconds, mean * 1e3, percentile(lat, 0.5) * 1e3,
+               percentile(lat, 0.99) * 1e3, m.second.bytes / seconds / 1e6);
+    }
+    printf("elapsed %.3fs\n", seconds);
+}
+
+int main(int argc, char** argv) {
+	initLogging();
+	auto log = logger();
+
+	if (argc != 2) {
+		cerr << "Usage: " << argv[0] << " [config_file]" << endl;
+		return EX_USAGE;
+	}
+
+	INIReader config(argv[1]);
+	if (config.ParseError() < 0) {
+		cerr << "Error parsing config file " << argv[1] << endl;
+		return EX_CONFIG;
+	}
+
+	Settings settings;
+	if (!loadSettings(config, settings)) {
+		return EX_CONFIG;
+	}
+
+	mt19937_64 rng(settings.seed);
+	string pool(POOL_SIZE, '\0');
+	for (auto& c: pool) {
+		c = (char) (rng() & 0xff);
+	}
+
+	// a recording is split by key, so each key's requests stay in order
+	vector<vector<RecordedRpc>> shares(settings.threads);
+	if (settings.mode == "trace") {
+		vector<RecordedRpc> records;
+		for (auto& path: settings.traceFiles) {
+			ifstream in(path);
+			if (!in) {
+				log->error("Unable to read recording {}", path);
+				return EX_NOINPUT;
+			}
+			string line;
+			RecordedRpc r;
+			while (getline(in, line)) {
+				if (parse_recorded_rpc(line, r)) {
+					records.push_back(r);
+				}
+			}
+		}
+		// stamps are wall clock, so recordings from several servers
+		// interleave as they happened; replay from the earliest
+		stable_sort(records.begin(), records.end(),
+		            [](const RecordedRpc& a, const RecordedRpc& b) { return a.start_us < b.start_us; });
+		uint64_t first = records.empty() ? 0 : records.front().start_us;
+		for (auto& r: records) {
+			r.start_us -= first;
+		}
+		for (size_t i = 0; i < records.size(); i++) {
+			const string& key = records[i].key;
+			size_t t = key == "-" ? i % settings.threads : placement_hash(key, 0) % settings.threads;
+			shares[t].push_back(records[i]);
+		}
+		log->info("Replaying {} rpcs at speed {}", records.size(), settings.speed);
+	} else {
+		log->info("Generating {} synthetic requests", settings.requests);
+	}
+
+	vector<unique_ptr<Worker>> workers;
+	vector<thread> threads;
+	for (int i = 0; i < settings.threads; i++) {
+		workers.push_back(unique_ptr<Worker>(new Worker(settings, pool)));
+	}
+	steady::time_point start = steady::now();
+	for (int i = 0; i < settings.threads; i++) {
+		Worker* w = workers[i].get();
+		if (settings.mode == "trace") {
+			threads.push_back(thread([w, &shares, i]() { w->replay(shares[i]); }));
+		} else {
+			int requests = settings.requests / settings.threads +
+				(i < settings.requests % settings.threads ? 1 : 0);
+			threads.push_back(thread([w, requests, i]() { w->synthetic(requests, i); }));
+		}
+	}
+	for (auto& t: threads) {
+		t.join();
+	}
+
+	report(workers, chrono::duration<double>(steady::now() - start).count());
+	return 0;
+}
@@ -0,0 +1,100 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <sysexits.h>
+#include <stdio.h>
+
+#include "Trace.hpp"
+
+using namespace std;
+
+// converts binary trace files into one Chrome trace JSON document
+// (chrome://tracing or ui.perfetto.dev), one process per file
+
+static string quote(const string& s) {
+	string out = "\"";
+	for (char c: s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char) c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char) c);
+			out += buf;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+static bool convert(const char* path, bool& first) {
+	ifstream in(path, ios::binary);
+	char magic[8];
+	TraceHeader header;
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+	    !in.read((char*) &header, sizeof(header))) {
+		cerr << path << " is not a trace file" << endl;
+		return false;
+	}
+	string label(header.label_len, '\0');
+	in.read(&label[0], header.label_len);
+
+	const char* sep = first ? "\n" : ",\n";
+	first = false;
+	cout << sep << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << header.pid
+	     << ",\"args\":{\"name\":" << quote(label) << "}}";
+
+	vector<string> names;
+	char tag;
+	while (in.get(tag)) {
+		if (tag == TRACE_NAME) {
+			uint16_t id, len;
+			in.read((char*) &id, sizeof(id));
+			in.read((char*) &len, sizeof(len));
+			string name(len, '\0');
+			in.read(&name[0], len);
+			if (names.size() <= id) {
+				names.resize(id + 1);
+			}
+			names[id] = name;
+		} else if (tag == TRACE_SPAN) {
+			TraceRecord r;
+			if (!in.read((char*) &r, sizeof(r))) {
+				break; // torn final record
+			}
+			string name = r.name < names.size() ? names[r.name] : "span" + to_string(r.name);
+			char times[64];
+			snprintf(times, sizeof(times), "%.3f,\"dur\":%.3f",
+			         (r.start_ns + header.epoch_ns) / 1000.0, r.dur_ns / 1000.0);
+			cout << ",\n{\"ph\":\"X\",\"name\":" << quote(name) << ",\"pid\":" << header.pid
+			     << ",\"tid\":" << r.thread << ",\"ts\":" << times
+			     << ",\"args\":{\"bytes\":" << r.bytes << ",\"peer\":" << r.peer << "}}";
+		} else {
+			cerr << path << ": corrupt record, stopping" << endl;
+			break;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cerr << "Usage: " << argv[0] << " [trace_file]... > trace.json" << endl;
+		return EX_USAGE;
+	}
+
+	bool first = true;
+	int status = 0;
+	cout << "{\"traceEvents\":[";
+	for (int i = 1; i < argc; i++) {
+		if (!convert(argv[i], first)) {
+			status = EX_DATAERR;
+		}
+	}
+	cout << "\n]}" << endl;
+
+	return status;
+}